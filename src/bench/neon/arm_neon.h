@@ -0,0 +1,89 @@
+// Scalar stand-in for the NEON intrinsics used by tinyexr, following the
+// ARM definitions lane by lane. Lets reorder_bench check the NEON kernels
+// for bit exactness on a host without an ARM compiler:
+//
+//   c++ -O2 -std=c++11 -U__SSE2__ -D__ARM_NEON -I neon -I.. reorder_bench.cpp
+//
+// Says nothing about speed, use a real ARM build for that.
+
+#ifndef BENCH_ARM_NEON_H
+#define BENCH_ARM_NEON_H
+
+#include <stdint.h>
+#include <string.h>
+
+struct uint8x16_t
+{
+	uint8_t lane[16];
+};
+
+struct uint8x16x2_t
+{
+	uint8x16_t val[2];
+};
+
+static inline uint8x16_t vld1q_u8(const uint8_t *p)
+{
+	uint8x16_t r;
+	memcpy(r.lane, p, 16);
+	return r;
+}
+
+static inline void vst1q_u8(uint8_t *p, uint8x16_t v)
+{
+	memcpy(p, v.lane, 16);
+}
+
+// De-interleaves even and odd bytes.
+static inline uint8x16x2_t vld2q_u8(const uint8_t *p)
+{
+	uint8x16x2_t r;
+	for (int i = 0; i < 16; i++) {
+		r.val[0].lane[i] = p[2 * i];
+		r.val[1].lane[i] = p[2 * i + 1];
+	}
+	return r;
+}
+
+static inline void vst2q_u8(uint8_t *p, uint8x16x2_t v)
+{
+	for (int i = 0; i < 16; i++) {
+		p[2 * i] = v.val[0].lane[i];
+		p[2 * i + 1] = v.val[1].lane[i];
+	}
+}
+
+static inline uint8x16_t vdupq_n_u8(uint8_t x)
+{
+	uint8x16_t r;
+	memset(r.lane, x, 16);
+	return r;
+}
+
+static inline uint8x16_t vaddq_u8(uint8x16_t a, uint8x16_t b)
+{
+	for (int i = 0; i < 16; i++) a.lane[i] = (uint8_t)(a.lane[i] + b.lane[i]);
+	return a;
+}
+
+static inline uint8x16_t vsubq_u8(uint8x16_t a, uint8x16_t b)
+{
+	for (int i = 0; i < 16; i++) a.lane[i] = (uint8_t)(a.lane[i] - b.lane[i]);
+	return a;
+}
+
+static inline uint8x16_t veorq_u8(uint8x16_t a, uint8x16_t b)
+{
+	for (int i = 0; i < 16; i++) a.lane[i] ^= b.lane[i];
+	return a;
+}
+
+// Lanes n..15 of a followed by lanes 0..n-1 of b.
+static inline uint8x16_t vextq_u8(uint8x16_t a, uint8x16_t b, int n)
+{
+	uint8x16_t r;
+	for (int i = 0; i < 16; i++) r.lane[i] = i + n < 16 ? a.lane[i + n] : b.lane[i + n - 16];
+	return r;
+}
+
+#endif
@@ -0,0 +1,134 @@
+// Bit exactness and throughput of the SIMD byte reordering and predictor
+// kernels of tinyexr's ZIP and RLE codecs against the scalar versions.
+//
+//   c++ -O2 -std=c++11 -I.. reorder_bench.cpp -o reorder_bench
+//   ./reorder_bench
+//
+// Every kernel the build and CPU support is compared with the scalar one at
+// all sizes up to 300 bytes and a few large ones, at unaligned offsets, and
+// checked for writes past the end. Exits with 1 on any mismatch. See
+// neon/arm_neon.h to check the NEON kernels on other hosts.
+
+#define TINYEXR_IMPLEMENTATION
+#include "ext/tinyexr.h"
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace tinyexr;
+
+static const unsigned char canary = 0xcd;
+static const size_t slack = 64;
+
+static std::vector<ReorderKernels> kernels()
+{
+	std::vector<ReorderKernels> all;
+	ReorderKernels scalar = { "scalar", SplitBytesRef, MergeBytesRef, EncodePredictorRef, DecodePredictorRef };
+	all.push_back(scalar);
+#if TINYEXR_SIMD_SSE2
+	ReorderKernels sse2 = { "sse2", SplitBytesSSE2, MergeBytesSSE2, EncodePredictorSSE2, DecodePredictorSSE2 };
+	all.push_back(sse2);
+#endif
+#if TINYEXR_SIMD_AVX2
+	if (CpuHasAVX2()) {
+		ReorderKernels avx2 = { "avx2", SplitBytesAVX2, MergeBytesAVX2, EncodePredictorAVX2, DecodePredictorAVX2 };
+		all.push_back(avx2);
+	}
+#endif
+#if TINYEXR_SIMD_NEON
+	ReorderKernels neon = { "neon", SplitBytesNEON, MergeBytesNEON, EncodePredictorNEON, DecodePredictorNEON };
+	all.push_back(neon);
+#endif
+	return all;
+}
+
+static bool same(const char *kernel, const char *step, const unsigned char *out, const unsigned char *expected, size_t n, int offset)
+{
+	if (memcmp(out, expected, n) == 0 && out[n] == canary) return true;
+	fprintf(stderr, "%s %s differs, %zu bytes at offset %d\n", kernel, step, n, offset);
+	return false;
+}
+
+// Runs each step of the encoding and decoding of the kernel on the output of
+// the previous step of the scalar kernel.
+static int check(const ReorderKernels &scalar, const ReorderKernels &k, const unsigned char *src, size_t n, int offset)
+{
+	std::vector<unsigned char> split(n + slack, canary), encoded, merged(n + slack, canary);
+	scalar.split_bytes(split.data(), src, n);
+	encoded = split;
+	scalar.encode_predictor(encoded.data(), n);
+
+	std::vector<unsigned char> buf(n + slack + offset, canary);
+	unsigned char *out = buf.data() + offset;
+	int failures = 0;
+
+	k.split_bytes(out, src, n);
+	failures += !same(k.name, "split", out, split.data(), n, offset);
+	memcpy(out, split.data(), n);
+	k.encode_predictor(out, n);
+	failures += !same(k.name, "encode", out, encoded.data(), n, offset);
+	memcpy(out, encoded.data(), n);
+	k.decode_predictor(out, n);
+	failures += !same(k.name, "decode", out, split.data(), n, offset);
+	k.merge_bytes(merged.data(), split.data(), n);
+	failures += !same(k.name, "merge", merged.data(), src, n, offset);
+	return failures;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+	std::vector<ReorderKernels> all = kernels();
+	printf("selected %s\n", GetReorderKernels().name);
+
+	std::vector<size_t> sizes;
+	for (size_t n = 0; n <= 300; n++) sizes.push_back(n);
+	sizes.push_back(4093);
+	sizes.push_back(65536);
+	sizes.push_back(1 << 20);
+	sizes.push_back((1 << 20) + 77);
+
+	std::mt19937 rng(1);
+	int checks = 0, failures = 0;
+	for (size_t n : sizes) {
+		for (int offset = 0; offset < 4; offset++) {
+			std::vector<unsigned char> src(n + offset);
+			for (auto &b : src) b = (unsigned char)rng();
+			for (size_t k = 1; k < all.size(); k++) {
+				failures += check(all[0], all[k], src.data() + offset, n, offset);
+				checks += 4;
+			}
+		}
+	}
+	printf("%d checks, %d mismatches\n", checks, failures);
+
+	// One scanline chunk of a wide half image.
+	const size_t n = 256 * 1024;
+	const int reps = 2000;
+	std::vector<unsigned char> src(n), tmp(n), dst(n);
+	for (size_t i = 0; i < n; i++) src[i] = (unsigned char)(i * 7 + (i >> 9));
+	for (auto &k : all) {
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++) {
+			k.split_bytes(tmp.data(), src.data(), n);
+			k.encode_predictor(tmp.data(), n);
+		}
+		double encode = seconds_since(start);
+		start = std::chrono::steady_clock::now();
+		for (int r = 0; r < reps; r++) {
+			k.decode_predictor(tmp.data(), n);
+			k.merge_bytes(dst.data(), tmp.data(), n);
+		}
+		double decode = seconds_since(start);
+		printf("%-6s encode %6.2f GB/s  decode %6.2f GB/s\n", k.name,
+			n * (double)reps / encode / 1e9, n * (double)reps / decode / 1e9);
+	}
+	return failures ? 1 : 0;
+}
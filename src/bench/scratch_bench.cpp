@@ -0,0 +1,219 @@
+// Heap allocations and time of encoding and decoding a frame one scanline
+// chunk at a time with tinyexr, with and without a scratch bound to the
+// thread, for every compression.
+//
+//   c++ -O2 -std=c++11 -I.. scratch_bench.cpp -o scratch_bench -lpthread
+//   ./scratch_bench [width height iterations]
+//
+// On glibc every malloc is counted, including the ones of miniz, elsewhere
+// only operator new.
+
+#define TINYEXR_IMPLEMENTATION
+#include "ext/tinyexr.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static std::atomic<unsigned long long> g_allocations(0);
+
+#if defined(__GLIBC__)
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void __libc_free(void *p);
+
+extern "C" void *malloc(size_t size)
+{
+	g_allocations++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+	g_allocations++;
+	return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+	g_allocations++;
+	return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p)
+{
+	__libc_free(p);
+}
+#else
+void *operator new(size_t size)
+{
+	g_allocations++;
+	void *p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+#endif
+
+struct result
+{
+	unsigned long long encode_allocations = 0;
+	unsigned long long decode_allocations = 0;
+	double encode_seconds = 0.0;
+	double decode_seconds = 0.0;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Encodes the frame chunk by chunk into a file image and decodes it again,
+// as the exrtool workers do, counting the allocations of the chunk calls.
+static bool run(int compression, int width, int height, int iterations, bool scratch, result &res)
+{
+	const int num_channels = 4;
+	std::vector<std::vector<float>> planes(num_channels);
+	std::vector<EXRChannelInfo> channels(num_channels);
+	std::vector<int> pixel_types(num_channels, TINYEXR_PIXELTYPE_FLOAT);
+	for (int c = 0; c < num_channels; c++) {
+		planes[c].resize((size_t)width * height);
+		for (size_t i = 0; i < planes[c].size(); i++) {
+			planes[c][i] = (float)((i * (c + 3) + i / width * 7) % 4096) / 64.0f;
+		}
+		memset(&channels[c], 0, sizeof(channels[c]));
+		snprintf(channels[c].name, sizeof(channels[c].name), "%c", "ABGR"[c]);
+	}
+
+	EXRHeader header;
+	InitEXRHeader(&header);
+	header.num_channels = num_channels;
+	header.channels = channels.data();
+	header.pixel_types = pixel_types.data();
+	header.requested_pixel_types = pixel_types.data();
+	header.compression_type = compression;
+	header.data_window.max_x = width - 1;
+	header.data_window.max_y = height - 1;
+	header.display_window = header.data_window;
+
+	int lines_per_chunk = EXRNumScanlinesPerChunk(compression);
+	int num_chunks = (height + lines_per_chunk - 1) / lines_per_chunk;
+	size_t bound = EXRScanlineChunkBound(&header, width, lines_per_chunk);
+	std::vector<unsigned char> chunk(bound);
+	std::vector<std::vector<float>> decoded(num_channels, std::vector<float>((size_t)width * lines_per_chunk));
+
+	EXRScratch *thread_scratch = scratch ? CreateEXRScratch() : NULL;
+	EXRSetThreadScratch(thread_scratch);
+
+	const char *err = NULL;
+	unsigned char *header_memory = NULL;
+	size_t header_size = SaveEXRHeaderToMemory(&header, width, height, &header_memory, &err);
+	bool ok = header_size > 0;
+
+	for (int it = 0; it < iterations && ok; it++) {
+		std::vector<unsigned char> file(header_memory, header_memory + header_size);
+		file.resize(header_size + (size_t)num_chunks * 8);
+
+		unsigned long long allocations = g_allocations.load();
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < num_chunks && ok; i++) {
+			int y = i * lines_per_chunk;
+			const unsigned char *lines[num_channels];
+			for (int c = 0; c < num_channels; c++) {
+				lines[c] = (const unsigned char*)(planes[c].data() + (size_t)y * width);
+			}
+			size_t size = EncodeEXRScanlineChunk(chunk.data(), chunk.size(), &header, lines,
+				width, y, std::min(lines_per_chunk, height - y), &err);
+			ok = size > 0;
+
+			// Outside of the measured calls.
+			res.encode_seconds += seconds_since(start);
+			res.encode_allocations += g_allocations.load() - allocations;
+			uint64_t offset = file.size();
+			for (int b = 0; b < 8; b++) {
+				file[header_size + (size_t)i * 8 + b] = (unsigned char)(offset >> (b * 8));
+			}
+			file.insert(file.end(), chunk.begin(), chunk.begin() + size);
+			allocations = g_allocations.load();
+			start = std::chrono::steady_clock::now();
+		}
+		if (!ok) break;
+
+		EXRVersion version;
+		EXRHeader loaded;
+		InitEXRHeader(&loaded);
+		ok = ParseEXRVersionFromMemory(&version, file.data(), file.size()) == TINYEXR_SUCCESS
+			&& ParseEXRHeaderFromMemory(&loaded, &version, file.data(), file.size(), &err) == TINYEXR_SUCCESS;
+		if (!ok) break;
+
+		unsigned char *outputs[num_channels];
+		for (int c = 0; c < num_channels; c++) {
+			outputs[c] = (unsigned char*)decoded[c].data();
+		}
+		allocations = g_allocations.load();
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < num_chunks && ok; i++) {
+			int num_lines;
+			ok = DecodeEXRScanlineChunkFromMemory(outputs, &num_lines, &loaded, file.data(), file.size(), i, &err) == TINYEXR_SUCCESS;
+
+			res.decode_seconds += seconds_since(start);
+			res.decode_allocations += g_allocations.load() - allocations;
+			size_t first = (size_t)i * lines_per_chunk * width;
+			for (int c = 0; ok && c < num_channels; c++) {
+				if (memcmp(decoded[c].data(), planes[c].data() + first, (size_t)num_lines * width * sizeof(float))) {
+					fprintf(stderr, "chunk %d of channel %d differs\n", i, c);
+					ok = false;
+				}
+			}
+			allocations = g_allocations.load();
+			start = std::chrono::steady_clock::now();
+		}
+		FreeEXRHeader(&loaded);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "failed: %s\n", err ? err : "");
+		FreeEXRErrorMessage(err);
+	}
+	free(header_memory);
+	EXRSetThreadScratch(NULL);
+	FreeEXRScratch(thread_scratch);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int width = argc > 3 ? atoi(argv[1]) : 1920;
+	int height = argc > 3 ? atoi(argv[2]) : 1080;
+	int iterations = argc > 3 ? atoi(argv[3]) : 5;
+
+	struct { int type; const char *name; } compressions[] = {
+		{ TINYEXR_COMPRESSIONTYPE_RLE, "RLE" },
+		{ TINYEXR_COMPRESSIONTYPE_ZIPS, "ZIPS" },
+		{ TINYEXR_COMPRESSIONTYPE_ZIP, "ZIP" },
+		{ TINYEXR_COMPRESSIONTYPE_PIZ, "PIZ" },
+	};
+
+	printf("%dx%d, 4 float channels, allocations and ms per frame\n", width, height);
+	printf("%-5s %-8s %12s %10s %12s %10s\n", "", "scratch", "enc allocs", "enc ms", "dec allocs", "dec ms");
+	for (auto &compression : compressions) {
+		for (int scratch = 0; scratch < 2; scratch++) {
+			result res;
+			if (!run(compression.type, width, height, iterations, scratch != 0, res)) return 1;
+			printf("%-5s %-8s %12llu %10.2f %12llu %10.2f\n", compression.name, scratch ? "yes" : "no",
+				res.encode_allocations / iterations, res.encode_seconds * 1e3 / iterations,
+				res.decode_allocations / iterations, res.decode_seconds * 1e3 / iterations);
+		}
+	}
+	return 0;
+}
@@ -1,205 +1,3626 @@
 #include "exrtool.h"
 #include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
+#include <string.h>
 
 #include <vector>
+#include <algorithm>
 #include <map>
+#include <deque>
 #include <unordered_set>
+#include <unordered_map>
 #include <string>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <math.h>
 
 #include "ext/tinyexr.h"
 
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+	#include <psapi.h>
+	#include <malloc.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/resource.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#if defined(__linux__)
+		#include <sys/vfs.h>
+		#include <sys/syscall.h>
+		#include <sched.h>
+	#elif defined(__APPLE__)
+		#include <sys/param.h>
+		#include <sys/mount.h>
+	#endif
+	#if defined(__GLIBC__)
+		#include <malloc.h>
+	#endif
+#endif
+
+#if defined(_WIN32)
+static bool widen(const char *str, wchar_t *dst, int size)
+{
+	return MultiByteToWideChar(CP_UTF8, 0, str, -1, dst, size) != 0;
+}
+#endif
+
+static FILE *open_file(const char *name, const char *mode)
+{
+#if defined(_WIN32)
+	wchar_t wname[1024], wmode[8];
+	if (!widen(name, wname, 1024)) return nullptr;
+	if (!widen(mode, wmode, 8)) return nullptr;
+	return _wfopen(wname, wmode);
+#else
+	return fopen(name, mode);
+#endif
+}
+
+static bool file_size(FILE *f, uint64_t *size)
+{
+#if defined(_WIN32)
+	if (_fseeki64(f, 0, SEEK_END)) return false;
+	int64_t end = _ftelli64(f);
+	if (end < 0 || _fseeki64(f, 0, SEEK_SET)) return false;
+#else
+	if (fseeko(f, 0, SEEK_END)) return false;
+	off_t end = ftello(f);
+	if (end < 0 || fseeko(f, 0, SEEK_SET)) return false;
+#endif
+	*size = (uint64_t)end;
+	return true;
+}
+
+// Buffer and file offset alignment for unbuffered I/O.
+static const size_t direct_alignment = 4096;
+
+static size_t align_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+static unsigned char *alloc_aligned(size_t size)
+{
+#if defined(_WIN32)
+	return (unsigned char*)_aligned_malloc(size, direct_alignment);
+#else
+	void *ptr = nullptr;
+	if (posix_memalign(&ptr, direct_alignment, size)) return nullptr;
+	return (unsigned char*)ptr;
+#endif
+}
+
+static void free_aligned(void *ptr)
+{
+#if defined(_WIN32)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+// Transparent huge page size, the alignment huge page backed mappings need.
+static const size_t huge_page_size = (size_t)2 << 20;
+
+// Map `size` bytes of zeroed anonymous memory, a multiple of the page size.
+// With `huge` the mapping is aligned to and backed by huge pages where
+// possible, `size` must then be a multiple of `huge_page_size`.
+static unsigned char *map_pages(size_t size, bool huge)
+{
+#if defined(_WIN32)
+	// Large pages need the lock memory privilege, fall back silently
+	SIZE_T large = GetLargePageMinimum();
+	void *ptr = nullptr;
+	if (huge && large > 0 && size % large == 0) {
+		ptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+	}
+	if (!ptr) ptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	return (unsigned char*)ptr;
+#else
+	size_t extra = huge ? huge_page_size : 0;
+	void *ptr = mmap(NULL, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) return nullptr;
+	if (!huge) return (unsigned char*)ptr;
+
+	// Trim the over-allocation down to an aligned range
+	uintptr_t start = (uintptr_t)ptr;
+	uintptr_t aligned = (uintptr_t)align_up((size_t)start, huge_page_size);
+	if (aligned > start) munmap(ptr, aligned - start);
+	if (extra > aligned - start) munmap((void*)(aligned + size), extra - (aligned - start));
+#if defined(MADV_HUGEPAGE)
+	madvise((void*)aligned, size, MADV_HUGEPAGE);
+#endif
+	return (unsigned char*)aligned;
+#endif
+}
+
+static void unmap_pages(unsigned char *ptr, size_t size)
+{
+#if defined(_WIN32)
+	(void)size;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, size);
+#endif
+}
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+	auto duration = std::chrono::steady_clock::now() - start;
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+// CPU and memory available to the process, zero where unknown or unlimited.
+struct system_limits
+{
+	size_t cpus = 0;
+	size_t affinity_cpus = 0;
+	double cpu_quota = 0.0;
+	uint64_t memory_limit = 0;
+	uint64_t physical_memory = 0;
+
+	// CPUs the process may run on grouped by NUMA node, empty when there is
+	// only a single node.
+	std::vector<std::vector<int>> nodes;
+
+	// CPUs the process can keep busy: the cores it may run on, capped by
+	// the CPU time quota.
+	size_t usable_cpus() const
+	{
+		size_t usable = std::max(cpus, (size_t)1);
+		if (affinity_cpus > 0) usable = std::min(usable, affinity_cpus);
+		if (cpu_quota > 0.0) usable = std::min(usable, (size_t)std::ceil(cpu_quota));
+		return std::max(usable, (size_t)1);
+	}
+
+	// Narrow the affinity and nodes to an explicit CPU set.
+	void restrict_to(const std::vector<int> &set)
+	{
+		if (set.empty()) return;
+		affinity_cpus = affinity_cpus > 0 ? std::min(affinity_cpus, set.size()) : set.size();
+
+		std::vector<std::vector<int>> kept;
+		for (const std::vector<int> &node : nodes) {
+			std::vector<int> cpus;
+			for (int cpu : node) {
+				if (std::find(set.begin(), set.end(), cpu) != set.end()) cpus.push_back(cpu);
+			}
+			if (!cpus.empty()) kept.push_back(cpus);
+		}
+		if (kept.size() == 1) kept.clear();
+		nodes = kept;
+	}
+};
+
+#if defined(__linux__)
+static bool read_line(const std::string &path, char *buf, size_t size)
+{
+	FILE *f = fopen(path.c_str(), "r");
+	if (!f) return false;
+	bool ok = fgets(buf, (int)size, f) != nullptr;
+	fclose(f);
+	return ok;
+}
+
+// Parse a kernel CPU or node list such as "0-3,8-11".
+static std::vector<int> parse_list(const char *str)
+{
+	std::vector<int> list;
+	while (*str && *str != '\n') {
+		char *end;
+		long first = strtol(str, &end, 10), last = first;
+		if (end == str) break;
+		if (*end == '-') last = strtol(end + 1, &end, 10);
+		for (long i = first; i <= last; i++) list.push_back((int)i);
+		str = *end == ',' ? end + 1 : end;
+	}
+	return list;
+}
+
+// Mount point of the hierarchy of `controller`, or of the unified (v2)
+// hierarchy for an empty name, and the cgroup of the process within it.
+static bool cgroup_dir(const char *controller, std::string &root, std::string &path)
+{
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (!f) return false;
+
+	char line[1024];
+	bool found = false;
+	while (!found && fgets(line, sizeof(line), f)) {
+		// "<id>:<controllers>:<path>"
+		char *list = strchr(line, ':');
+		char *dir = list ? strchr(list + 1, ':') : nullptr;
+		if (!dir) continue;
+		*dir++ = '\0';
+		dir[strcspn(dir, "\n")] = '\0';
+
+		std::string controllers = std::string(",") + (list + 1) + ",";
+		if (*controller ? controllers.find(std::string(",") + controller + ",") != std::string::npos : controllers == ",,") {
+			path = dir;
+			found = true;
+		}
+	}
+	fclose(f);
+
+	if (*controller) {
+		root = std::string("/sys/fs/cgroup/") + controller;
+	} else {
+		// Hybrid setups mount the unified hierarchy next to the v1 ones
+		struct stat st;
+		bool unified = stat("/sys/fs/cgroup/cgroup.controllers", &st) == 0;
+		root = unified ? "/sys/fs/cgroup" : "/sys/fs/cgroup/unified";
+	}
+	if (path == "/") path.clear();
+	return found;
+}
+
+// Smallest limit `parse()` finds for the cgroup `path` or any of its parents
+// up to the root of the hierarchy, which is all containers usually see.
+template <typename Parse>
+static double cgroup_limit(const std::string &root, std::string path, Parse parse)
+{
+	double limit = 0.0;
+	for (;;) {
+		double value = 0.0;
+		if (parse(root + path, value) && value > 0.0 && (limit == 0.0 || value < limit)) limit = value;
+		if (path.empty()) break;
+		size_t slash = path.find_last_of('/');
+		path.resize(slash != std::string::npos ? slash : 0);
+	}
+	return limit;
+}
+#endif
+
+static system_limits detect_limits()
+{
+	system_limits limits;
+	limits.cpus = std::thread::hardware_concurrency();
+
+#if defined(_WIN32)
+	DWORD_PTR process_mask, system_mask;
+	ULONGLONG allowed_mask = ~0ull;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+		allowed_mask = process_mask;
+		for (; process_mask; process_mask &= process_mask - 1) limits.affinity_cpus++;
+	}
+	MEMORYSTATUSEX status = { sizeof(status) };
+	if (GlobalMemoryStatusEx(&status)) limits.physical_memory = status.ullTotalPhys;
+
+	// Only the first processor group, which affinity masks are limited to
+	ULONG highest_node;
+	if (GetNumaHighestNodeNumber(&highest_node) && highest_node > 0) {
+		for (ULONG node = 0; node <= highest_node; node++) {
+			ULONGLONG mask;
+			if (!GetNumaNodeProcessorMask((UCHAR)node, &mask)) continue;
+			mask &= allowed_mask;
+			std::vector<int> cpus;
+			for (int cpu = 0; cpu < 64; cpu++) {
+				if (mask >> cpu & 1) cpus.push_back(cpu);
+			}
+			if (!cpus.empty()) limits.nodes.push_back(cpus);
+		}
+	}
+#else
+	long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && page_size > 0) limits.physical_memory = (uint64_t)pages * (uint64_t)page_size;
+#endif
+
+#if defined(__linux__)
+	cpu_set_t set;
+	bool have_set = sched_getaffinity(0, sizeof(set), &set) == 0;
+	if (have_set) limits.affinity_cpus = CPU_COUNT(&set);
+
+	char nodes[256];
+	if (read_line("/sys/devices/system/node/online", nodes, sizeof(nodes))) {
+		for (int node : parse_list(nodes)) {
+			char buf[1024];
+			std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+			if (!read_line(path, buf, sizeof(buf))) continue;
+			std::vector<int> cpus;
+			for (int cpu : parse_list(buf)) {
+				if (!have_set || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set))) cpus.push_back(cpu);
+			}
+			// Memory only nodes and nodes outside of the affinity mask
+			if (!cpus.empty()) limits.nodes.push_back(cpus);
+		}
+	}
+
+	// Limits above 2^60 stand for unlimited in cgroup v1
+	const double unlimited = (double)((uint64_t)1 << 60);
+	std::string root, path;
+	if (cgroup_dir("", root, path)) {
+		limits.cpu_quota = cgroup_limit(root, path, [](const std::string &dir, double &value) {
+			char buf[64];
+			double quota, period;
+			if (!read_line(dir + "/cpu.max", buf, sizeof(buf))) return false;
+			if (sscanf(buf, "%lf %lf", &quota, &period) != 2 || period <= 0.0) return false;
+			value = quota / period;
+			return true;
+		});
+		limits.memory_limit = (uint64_t)cgroup_limit(root, path, [](const std::string &dir, double &value) {
+			char buf[64];
+			return read_line(dir + "/memory.max", buf, sizeof(buf)) && sscanf(buf, "%lf", &value) == 1;
+		});
+	}
+	if (limits.cpu_quota == 0.0 && cgroup_dir("cpu", root, path)) {
+		limits.cpu_quota = cgroup_limit(root, path, [](const std::string &dir, double &value) {
+			char buf[64];
+			double quota, period;
+			if (!read_line(dir + "/cpu.cfs_quota_us", buf, sizeof(buf)) || sscanf(buf, "%lf", &quota) != 1) return false;
+			if (!read_line(dir + "/cpu.cfs_period_us", buf, sizeof(buf)) || sscanf(buf, "%lf", &period) != 1) return false;
+			if (quota <= 0.0 || period <= 0.0) return false;
+			value = quota / period;
+			return true;
+		});
+	}
+	if (limits.memory_limit == 0 && cgroup_dir("memory", root, path)) {
+		limits.memory_limit = (uint64_t)cgroup_limit(root, path, [&](const std::string &dir, double &value) {
+			char buf[64];
+			return read_line(dir + "/memory.limit_in_bytes", buf, sizeof(buf)) && sscanf(buf, "%lf", &value) == 1 && value < unlimited;
+		});
+	}
+#endif
+
+	if (limits.nodes.size() == 1) limits.nodes.clear();
+	return limits;
+}
+
+// Restrict the calling thread to `cpus`. Memory it touches first is then
+// allocated on their node under the default first-touch policy.
+static void bind_thread(const std::vector<int> &cpus)
+{
+#if defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for (int cpu : cpus) {
+		if (cpu < (int)sizeof(mask) * 8) mask |= (DWORD_PTR)1 << cpu;
+	}
+	if (mask) SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+	}
+	sched_setaffinity(0, sizeof(set), &set);
+#else
+	(void)cpus;
+#endif
+}
+
+// Apply the CPU set, niceness and I/O priority of the run to the calling
+// thread, which all threads started by a run do first. Failures such as
+// missing privileges for raising the priority are ignored.
+static void govern_thread(const exrtool_input &input)
+{
+	if (input.num_cpus > 0) {
+		bind_thread(std::vector<int>(input.cpus, input.cpus + input.num_cpus));
+	}
+#if defined(_WIN32)
+	if (input.nice != 0) {
+		int priority = input.nice >= 10 ? THREAD_PRIORITY_LOWEST : input.nice > 0 ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_ABOVE_NORMAL;
+		SetThreadPriority(GetCurrentThread(), priority);
+	}
+	// Background mode lowers the I/O and memory priority along with the CPU
+	// priority, there is no separate best effort level.
+	if (input.io_priority == EXRTOOL_IO_PRIORITY_IDLE) {
+		SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+	}
+#elif defined(__linux__)
+	// Both are per thread on Linux
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	if (input.nice != 0) setpriority(PRIO_PROCESS, (id_t)tid, input.nice);
+#if defined(SYS_ioprio_set)
+	// IOPRIO_WHO_PROCESS with the class in the top bits, the lowest best
+	// effort level is 7
+	if (input.io_priority == EXRTOOL_IO_PRIORITY_LOW) syscall(SYS_ioprio_set, 1, (int)tid, 2 << 13 | 7);
+	if (input.io_priority == EXRTOOL_IO_PRIORITY_IDLE) syscall(SYS_ioprio_set, 1, (int)tid, 3 << 13);
+#endif
+#endif
+}
+
+// Bytes per second shared by the threads of a run. Tokens may go into debt
+// so that requests larger than the burst size work, the next request then
+// waits until the debt has been paid off. The bucket starts out empty so
+// that the average rate never exceeds the cap.
+struct token_bucket
+{
+	double rate = 0.0;
+	double burst = 0.0;
+	double tokens = 0.0;
+	std::mutex mutex;
+	std::chrono::steady_clock::time_point last;
+	std::atomic_uint64_t a_wait_ns { 0 };
+
+	bool limited() const { return rate > 0.0; }
+
+	void set_rate(double bytes_per_second)
+	{
+		rate = bytes_per_second;
+		burst = std::max(rate * 0.1, (double)(1 << 20));
+		tokens = 0.0;
+		last = std::chrono::steady_clock::now();
+	}
+
+	// Take `bytes` tokens, sleeping until they are available unless
+	// `cancelled` gets set.
+	void consume(size_t bytes, const std::atomic_bool &cancelled)
+	{
+		if (!limited()) return;
+		auto start = std::chrono::steady_clock::now();
+
+		double wait;
+		{
+			std::lock_guard<std::mutex> lg(mutex);
+			tokens = std::min(tokens + rate * (double)elapsed_ns(last) * 1e-9, burst);
+			last = start;
+			tokens -= (double)bytes;
+			wait = tokens < 0.0 ? -tokens / rate : 0.0;
+		}
+
+		auto until = start + std::chrono::nanoseconds((uint64_t)(wait * 1e9));
+		while (std::chrono::steady_clock::now() < until && !cancelled.load(std::memory_order_relaxed)) {
+			std::this_thread::sleep_for(std::min(until - std::chrono::steady_clock::now(), std::chrono::steady_clock::duration(std::chrono::milliseconds(20))));
+		}
+		if (wait > 0.0) a_wait_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+	}
+};
+
+// I/O calls are split into slices of this size when the bandwidth is capped.
+static const size_t throttle_slice = 1 << 20;
+
+// Work abandoned after `exrtool_cancel()`, next to the TINYEXR_ERROR codes.
+static const int error_cancelled = -100;
+
+// Return free heap memory to the OS where the allocator supports it.
+static void release_heap()
+{
+#if defined(_WIN32)
+	_heapmin();
+#elif defined(__GLIBC__)
+	malloc_trim(0);
+#endif
+}
+
+// Page faults of the process so far, minor and major.
+static uint64_t page_faults()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PageFaultCount;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) return 0;
+	return (uint64_t)usage.ru_minflt + (uint64_t)usage.ru_majflt;
+#endif
+}
+
+static void set_error(const char **err, const char *msg)
+{
+	if (!err) return;
+#if defined(_WIN32)
+	*err = _strdup(msg);
+#else
+	*err = strdup(msg);
+#endif
+}
+
 static uint32_t strip_frame(const char *str)
 {
-	const char *end = str + strlen(str);
-	while (end > str && !isdigit(end[-1])) end--;
-	const char *begin = end;
-	while (begin > str && isdigit(begin[-1])) begin--;
-	if (begin == end) return ~0u;
+	const char *end = str + strlen(str);
+	while (end > str && !isdigit(end[-1])) end--;
+	const char *begin = end;
+	while (begin > str && isdigit(begin[-1])) begin--;
+	if (begin == end) return ~0u;
+
+	return (uint32_t)atoi(begin);
+}
+
+// Codec scratch memory of the threads of a run, see `thread_scratch`.
+struct scratch_counters
+{
+	std::atomic_uint64_t a_bytes { 0 };
+	std::atomic_uint64_t a_allocations { 0 };
+	std::atomic_uint64_t a_reuses { 0 };
+};
+
+// Tinyexr codec scratch bound to the calling thread while alive, so that the
+// temporary buffers of every chunk are reused instead of allocated. `flush()`
+// adds its growth since the last call to the counters.
+struct thread_scratch
+{
+	static thread_local thread_scratch *t_current;
+
+	scratch_counters &counters;
+	EXRScratch *scratch;
+	size_t bytes = 0, allocations = 0, reuses = 0;
+
+	thread_scratch(scratch_counters &counters) : counters(counters), scratch(CreateEXRScratch())
+	{
+		EXRSetThreadScratch(scratch);
+		t_current = this;
+	}
+	thread_scratch(const thread_scratch&) = delete;
+	thread_scratch& operator=(const thread_scratch&) = delete;
+
+	~thread_scratch()
+	{
+		flush();
+		t_current = nullptr;
+		EXRSetThreadScratch(nullptr);
+		FreeEXRScratch(scratch);
+	}
+
+	void flush()
+	{
+		size_t now_bytes, now_allocations, now_reuses;
+		EXRScratchStats(scratch, &now_bytes, &now_allocations, &now_reuses);
+		counters.a_bytes.fetch_add(now_bytes - bytes, std::memory_order_relaxed);
+		counters.a_allocations.fetch_add(now_allocations - allocations, std::memory_order_relaxed);
+		counters.a_reuses.fetch_add(now_reuses - reuses, std::memory_order_relaxed);
+		bytes = now_bytes;
+		allocations = now_allocations;
+		reuses = now_reuses;
+	}
+
+	static void flush_current()
+	{
+		if (t_current) t_current->flush();
+	}
+};
+
+thread_local thread_scratch *thread_scratch::t_current = nullptr;
+
+// Persistent pool of worker threads running both frame tasks and the chunk
+// tasks spawned by them. Frame tasks are taken in submission order from a
+// shared queue by idle workers only. Chunk tasks go to the deque of the
+// spawning worker which runs the newest first, idle workers steal the oldest
+// ones from other deques. Threads waiting for chunk tasks run chunk tasks in
+// the meantime, so nested parallelism needs no extra threads and never blocks
+// a worker.
+struct task_pool
+{
+	typedef std::function<void()> task;
+
+	struct task_queue
+	{
+		std::mutex mutex;
+		std::deque<task> tasks;
+	};
+
+	// Workers are spawned on demand up to `max_workers`, their queues never
+	// move so that they can be stolen from while more workers are spawned.
+	// Workers from `a_active` up are retired and wait on `retire_cv`.
+	static const size_t max_workers = 1024;
+	std::mutex resize_mutex;
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<task_queue>> queues;
+	std::atomic_size_t a_spawned { 0 };
+	std::atomic_size_t a_active { 0 };
+	task_queue frame_queue;
+
+	std::mutex sleep_mutex;
+	std::condition_variable sleep_cv;
+	std::condition_variable retire_cv;
+	std::atomic_size_t a_queued { 0 };
+	bool stopping = false;
+
+	// Called first on every worker thread.
+	std::function<void()> thread_init;
+
+	// Scratch of the workers and of other threads of the run.
+	scratch_counters scratch;
+
+	// Time workers spent running tasks, including waiting on task groups.
+	std::atomic_uint64_t a_busy_ns { 0 };
+
+	// Workers not retired, which may be more than `a_active` right after the
+	// pool shrinks, and their number integrated over time up to `counted_at`.
+	// Guarded by `sleep_mutex`.
+	size_t running = 0;
+	uint64_t worker_ns = 0;
+	std::chrono::steady_clock::time_point counted_at;
+
+	// Steal chunk tasks of running frames before starting new frames, which
+	// finishes each frame sooner at the same throughput.
+	bool help_first = false;
+
+	// CPUs per NUMA node the workers are bound to round robin. Chunk tasks
+	// are only stolen within a node while there are frames left to start, so
+	// that a frame is decoded, merged and encoded where its buffers were
+	// first touched. `a_remote_tasks` counts those run on another node.
+	std::vector<std::vector<int>> nodes;
+	std::atomic_uint64_t a_remote_tasks { 0 };
+
+	// Threads calling `park()` block while the pool is paused.
+	std::mutex pause_mutex;
+	std::condition_variable pause_cv;
+	std::atomic_bool a_paused { false };
+	std::atomic_size_t a_parked { 0 };
+
+	static thread_local task_pool *t_pool;
+	static thread_local size_t t_index;
+
+	size_t size() const { return a_active.load(std::memory_order_relaxed); }
+
+	size_t node_of(size_t index) const { return nodes.empty() ? 0 : index % nodes.size(); }
+
+	void start(size_t num_threads)
+	{
+		queues.resize(max_workers);
+		resize(num_threads);
+	}
+
+	// Grow immediately or retire the workers past `num_threads` once they
+	// finish their current task.
+	void resize(size_t num_threads)
+	{
+		std::lock_guard<std::mutex> lg(resize_mutex);
+		if (stopping || queues.empty()) return;
+		num_threads = std::min(std::max(num_threads, (size_t)1), max_workers);
+
+		{
+			std::lock_guard<std::mutex> lg(sleep_mutex);
+			a_active.store(num_threads, std::memory_order_relaxed);
+			size_t spawned = a_spawned.load(std::memory_order_relaxed);
+			if (num_threads > spawned) count_running(num_threads - spawned);
+		}
+		retire_cv.notify_all();
+
+		for (size_t i = a_spawned.load(std::memory_order_relaxed); i < num_threads; i++) {
+			queues[i].reset(new task_queue());
+			a_spawned.store(i + 1, std::memory_order_release);
+			threads.emplace_back([=]() { worker(i); });
+		}
+	}
+
+	// With `sleep_mutex` held.
+	void count_running(ptrdiff_t delta)
+	{
+		worker_ns += running * elapsed_ns(counted_at);
+		counted_at = std::chrono::steady_clock::now();
+		running += delta;
+	}
+
+	// Workers integrated over time so far, an upper bound of `a_busy_ns`.
+	uint64_t worker_time_ns()
+	{
+		std::lock_guard<std::mutex> lg(sleep_mutex);
+		return worker_ns + running * elapsed_ns(counted_at);
+	}
+
+	// Workers may still be resizing the pool, `threads` is left alone once
+	// `stopping` is set.
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lg(resize_mutex);
+			std::lock_guard<std::mutex> lg2(sleep_mutex);
+			stopping = true;
+		}
+		sleep_cv.notify_all();
+		retire_cv.notify_all();
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		threads.clear();
+	}
+
+	void push(task_queue &queue, task fn)
+	{
+		{
+			std::lock_guard<std::mutex> lg(queue.mutex);
+			queue.tasks.push_back(std::move(fn));
+		}
+		a_queued.fetch_add(1, std::memory_order_relaxed);
+		{
+			std::lock_guard<std::mutex> lg(sleep_mutex);
+		}
+		sleep_cv.notify_one();
+	}
+
+	void submit_frame(task fn)
+	{
+		push(frame_queue, std::move(fn));
+	}
+
+	// Chunk tasks spawned outside of the pool are left for the workers to steal.
+	void spawn(task fn)
+	{
+		size_t index = t_pool == this ? t_index : 0;
+		push(*queues[index], std::move(fn));
+	}
+
+	bool pop(task_queue &queue, bool newest, task &fn)
+	{
+		std::lock_guard<std::mutex> lg(queue.mutex);
+		if (queue.tasks.empty()) return false;
+		if (newest) {
+			fn = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		} else {
+			fn = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		a_queued.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool frames_queued()
+	{
+		std::lock_guard<std::mutex> lg(frame_queue.mutex);
+		return !frame_queue.tasks.empty();
+	}
+
+	// Run a chunk task, preferring the newest one of the calling worker and
+	// then ones of workers on the same node.
+	bool run_chunk_task()
+	{
+		task fn;
+		bool found = false;
+		bool local = t_pool == this && !nodes.empty();
+		size_t self = t_pool == this ? t_index : 0;
+		size_t count = a_spawned.load(std::memory_order_acquire);
+		if (t_pool == this) found = pop(*queues[self], true, fn);
+		for (size_t i = 1; !found && i <= count; i++) {
+			size_t victim = (self + i) % count;
+			if (local && node_of(victim) != node_of(self)) continue;
+			found = pop(*queues[victim], false, fn);
+		}
+		if (!found && local && !frames_queued()) {
+			for (size_t i = 1; !found && i <= count; i++) {
+				size_t victim = (self + i) % count;
+				if (node_of(victim) == node_of(self)) continue;
+				found = pop(*queues[victim], false, fn);
+			}
+			if (found) a_remote_tasks.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (found) fn();
+		return found;
+	}
+
+	void set_paused(bool paused)
+	{
+		std::lock_guard<std::mutex> lg(pause_mutex);
+		a_paused.store(paused, std::memory_order_relaxed);
+		if (!paused) pause_cv.notify_all();
+	}
+
+	void park()
+	{
+		if (!a_paused.load(std::memory_order_relaxed)) return;
+		std::unique_lock<std::mutex> lock(pause_mutex);
+		a_parked.fetch_add(1, std::memory_order_relaxed);
+		pause_cv.wait(lock, [&]() { return !a_paused.load(std::memory_order_relaxed); });
+		a_parked.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void worker(size_t index)
+	{
+		t_pool = this;
+		t_index = index;
+		thread_scratch codec_scratch(scratch);
+		if (thread_init) thread_init();
+		if (!nodes.empty()) bind_thread(nodes[node_of(index)]);
+
+		for (;;) {
+			park();
+
+			task fn;
+			auto start = std::chrono::steady_clock::now();
+			bool own = pop(*queues[index], true, fn);
+
+			// Retire between frames, left over chunk tasks get stolen.
+			if (!own && index >= a_active.load(std::memory_order_relaxed)) {
+				std::unique_lock<std::mutex> lock(sleep_mutex);
+				count_running(-1);
+				retire_cv.wait(lock, [&]() { return stopping || index < a_active.load(std::memory_order_relaxed); });
+				if (stopping) break;
+				count_running(1);
+				continue;
+			}
+
+			if (own || (!help_first && pop(frame_queue, false, fn))) {
+				fn();
+				a_busy_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+				codec_scratch.flush();
+				continue;
+			}
+			if (run_chunk_task() || (help_first && pop(frame_queue, false, fn))) {
+				if (fn) fn();
+				a_busy_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+				codec_scratch.flush();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			sleep_cv.wait(lock, [&]() { return stopping || a_queued.load(std::memory_order_relaxed) > 0; });
+			if (stopping) break;
+		}
+
+		t_pool = nullptr;
+	}
+};
+
+thread_local task_pool *task_pool::t_pool = nullptr;
+thread_local size_t task_pool::t_index = 0;
+const size_t task_pool::max_workers;
+
+// Chunk tasks that can be waited on, the waiting thread helps running tasks.
+struct task_group
+{
+	// Yields before blocking once there are no tasks left to help with.
+	static const int max_spins = 64;
+
+	task_pool &pool;
+	std::atomic_size_t a_pending { 0 };
+
+	// The count reaches zero under `done_mutex`, so that the waiter can only
+	// return and destroy the group after the last task has let go of it.
+	std::mutex done_mutex;
+	std::condition_variable done_cv;
+
+	task_group(task_pool &pool) : pool(pool) { }
+
+	void spawn(std::function<void()> fn)
+	{
+		a_pending.fetch_add(1, std::memory_order_relaxed);
+		pool.spawn([this, fn]() {
+			fn();
+			std::lock_guard<std::mutex> lg(done_mutex);
+			if (a_pending.fetch_sub(1, std::memory_order_release) == 1) done_cv.notify_all();
+		});
+	}
+
+	// The remaining tasks are running elsewhere, possibly blocked on I/O, when
+	// none can be taken: block instead of keeping a core busy.
+	void wait()
+	{
+		int spins = 0;
+		while (a_pending.load(std::memory_order_acquire) > 0) {
+			if (pool.run_chunk_task()) {
+				spins = 0;
+				continue;
+			}
+			pool.park();
+			if (++spins < max_spins) {
+				std::this_thread::yield();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(done_mutex);
+			done_cv.wait(lock, [&]() { return a_pending.load(std::memory_order_acquire) == 0; });
+		}
+		std::lock_guard<std::mutex> lg(done_mutex);
+	}
+};
+
+// Call `fn(i)` for every `i` in `[0, count)` on up to `max_tasks` tasks
+// including the calling thread, which claim indices dynamically.
+static void parallel_for(task_pool &pool, size_t count, size_t max_tasks, const std::function<void(size_t)> &fn)
+{
+	std::atomic_size_t a_next(0);
+	auto loop = [&]() {
+		for (;;) {
+			size_t i = a_next.fetch_add(1, std::memory_order_relaxed);
+			if (i >= count) break;
+			fn(i);
+		}
+	};
+
+	size_t num_tasks = std::min(std::min(count, max_tasks), std::max(pool.size(), (size_t)1));
+	task_group group(pool);
+	for (size_t i = 1; i < num_tasks; i++) {
+		group.spawn(loop);
+	}
+	loop();
+	group.wait();
+}
+
+struct exrtool_run_file
+{
+	std::string name;
+	std::unordered_set<std::string> channels;
+
+	bool use_channel(const char *channel) const
+	{
+		return channels.count(channel) > 0;
+	}
+};
+
+// Size of a buffer counted towards the memory use of a run while it is alive.
+struct memory_charge
+{
+	exrtool_run *run = nullptr;
+	uint64_t size = 0;
+
+	memory_charge() { }
+	memory_charge(exrtool_run &run, uint64_t size);
+	memory_charge(const memory_charge&) = delete;
+	memory_charge& operator=(const memory_charge&) = delete;
+	memory_charge(memory_charge &&rhs) : run(rhs.run), size(rhs.size) { rhs.run = nullptr; }
+	memory_charge& operator=(memory_charge &&rhs)
+	{
+		if (this != &rhs) {
+			reset();
+			run = rhs.run;
+			size = rhs.size;
+			rhs.run = nullptr;
+		}
+		return *this;
+	}
+	~memory_charge() { reset(); }
+
+	void reset();
+};
+
+// Allocation through a host allocator, see `exrtool_allocator`.
+static bool has_allocator(const exrtool_allocator &allocator)
+{
+	return (allocator.malloc_fn && allocator.free_fn) || (allocator.aligned_malloc_fn && allocator.aligned_free_fn);
+}
+
+static bool has_aligned(const exrtool_allocator &allocator)
+{
+	return allocator.aligned_malloc_fn && allocator.aligned_free_fn;
+}
+
+static void *host_malloc(const exrtool_allocator &allocator, size_t size, exrtool_buffer_kind kind)
+{
+	if (!allocator.malloc_fn || !allocator.free_fn) return allocator.aligned_malloc_fn(size, 16, kind, allocator.user);
+	return allocator.malloc_fn(size, allocator.user);
+}
+
+static void host_free(const exrtool_allocator &allocator, void *ptr)
+{
+	if (!allocator.malloc_fn || !allocator.free_fn) {
+		allocator.aligned_free_fn(ptr, allocator.user);
+	} else {
+		allocator.free_fn(ptr, allocator.user);
+	}
+}
+
+// Without an aligned allocator the original pointer is stored in front of
+// the aligned one.
+static unsigned char *host_aligned_malloc(const exrtool_allocator &allocator, size_t size, size_t alignment, exrtool_buffer_kind kind)
+{
+	if (has_aligned(allocator)) return (unsigned char*)allocator.aligned_malloc_fn(size, alignment, kind, allocator.user);
+
+	unsigned char *raw = (unsigned char*)allocator.malloc_fn(size + alignment + sizeof(void*), allocator.user);
+	if (!raw) return nullptr;
+	unsigned char *ptr = raw + align_up((size_t)(uintptr_t)(raw + sizeof(void*)), alignment) - (size_t)(uintptr_t)raw;
+	memcpy(ptr - sizeof(void*), &raw, sizeof(void*));
+	return ptr;
+}
+
+static void host_aligned_free(const exrtool_allocator &allocator, unsigned char *ptr)
+{
+	if (has_aligned(allocator)) {
+		allocator.aligned_free_fn(ptr, allocator.user);
+		return;
+	}
+	void *raw;
+	memcpy(&raw, ptr - sizeof(void*), sizeof(void*));
+	allocator.free_fn(raw, allocator.user);
+}
+
+// Tinyexr side of the host allocator, see `EXRImage::allocator`.
+static void *exr_allocate(size_t size, int kind, void *user)
+{
+	return host_malloc(*(const exrtool_allocator*)user, size,
+		kind == TINYEXR_ALLOCATION_ENCODED ? EXRTOOL_BUFFER_CHUNK : EXRTOOL_BUFFER_IMAGE);
+}
+
+static void exr_deallocate(void *ptr, void *user)
+{
+	host_free(*(const exrtool_allocator*)user, ptr);
+}
+
+// Memory allocated the way tinyexr does for `allocator`.
+static void *exr_malloc(const EXRAllocator *allocator, size_t size, int kind)
+{
+	return allocator ? allocator->allocate(size, kind, allocator->user) : malloc(size);
+}
+
+static void exr_free(const EXRAllocator *allocator, void *ptr)
+{
+	if (!ptr) return;
+	if (allocator) {
+		allocator->deallocate(ptr, allocator->user);
+	} else {
+		free(ptr);
+	}
+}
+
+// Size classed page buffers recycled between the frames of a run, which in a
+// sequence nearly always have the same layout. Buffers of at least
+// `min_pooled` bytes are mapped directly from the OS and kept on a free list
+// per size class and NUMA node when released, smaller ones and all buffers
+// of a disabled pool are allocated with `alloc_aligned()`. With a host
+// `allocator` both come from it instead. Every buffer is aligned to
+// `direct_alignment`.
+struct buffer_pool
+{
+	static const size_t min_pooled = 64 << 10;
+
+	struct live_buffer
+	{
+		size_t size;
+		size_t node;
+	};
+
+	bool enabled = false;
+	bool huge_pages = false;
+	const exrtool_allocator *allocator = nullptr;
+	// Workers whose NUMA node a buffer belongs to.
+	const task_pool *workers = nullptr;
+
+	std::mutex mutex;
+	std::map<std::pair<size_t, size_t>, std::vector<unsigned char*>> free_lists;
+	std::unordered_map<unsigned char*, live_buffer> live;
+	uint64_t free_bytes = 0;
+
+	std::atomic_uint64_t a_allocations { 0 };
+	std::atomic_uint64_t a_reuses { 0 };
+
+	~buffer_pool() { trim(); }
+
+	// Round up to a quarter power of two step, sizes from 4 to 8 steps to
+	// whole steps. A request just above 4 steps gets 5, so up to a quarter of
+	// the requested size, a fifth of the buffer, is wasted.
+	size_t size_class(size_t size) const
+	{
+		size_t step = 1;
+		while (step <= size / 8) step <<= 1;
+		size = align_up(size, step);
+		if (huge_pages && size >= huge_page_size) size = align_up(size, huge_page_size);
+		return size;
+	}
+
+	size_t current_node() const
+	{
+		if (!workers || workers->nodes.empty() || task_pool::t_pool != workers) return 0;
+		return workers->node_of(task_pool::t_index);
+	}
+
+	// Uninitialized unless freshly mapped, null on failure.
+	unsigned char *acquire(size_t size, exrtool_buffer_kind kind)
+	{
+		if (!enabled || size < min_pooled) {
+			size = std::max(size, (size_t)1);
+			unsigned char *ptr = allocator ? host_aligned_malloc(*allocator, size, direct_alignment, kind) : alloc_aligned(size);
+			if (!ptr) return nullptr;
+			a_allocations.fetch_add(1, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> lg(mutex);
+			live[ptr] = live_buffer { 0, 0 };
+			return ptr;
+		}
+
+		size_t size_class = this->size_class(size);
+		size_t node = current_node();
+		{
+			std::lock_guard<std::mutex> lg(mutex);
+			std::vector<unsigned char*> &list = free_lists[std::make_pair(size_class, node)];
+			if (!list.empty()) {
+				unsigned char *ptr = list.back();
+				list.pop_back();
+				free_bytes -= size_class;
+				live[ptr] = live_buffer { size_class, node };
+				a_reuses.fetch_add(1, std::memory_order_relaxed);
+				return ptr;
+			}
+		}
+
+		unsigned char *ptr;
+		if (allocator) {
+			ptr = host_aligned_malloc(*allocator, size_class, direct_alignment, kind);
+		} else {
+			ptr = map_pages(size_class, huge_pages && size_class >= huge_page_size);
+		}
+		if (!ptr) return nullptr;
+		a_allocations.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lg(mutex);
+		live[ptr] = live_buffer { size_class, node };
+		return ptr;
+	}
+
+	// Returns false if `ptr` does not come from this pool.
+	bool release(unsigned char *ptr)
+	{
+		if (!ptr) return false;
+		std::lock_guard<std::mutex> lg(mutex);
+		auto it = live.find(ptr);
+		if (it == live.end()) return false;
+		live_buffer buffer = it->second;
+		live.erase(it);
+
+		if (buffer.size == 0) {
+			if (allocator) {
+				host_aligned_free(*allocator, ptr);
+			} else {
+				free_aligned(ptr);
+			}
+		} else {
+			free_lists[std::make_pair(buffer.size, buffer.node)].push_back(ptr);
+			free_bytes += buffer.size;
+		}
+		return true;
+	}
+
+	// Return the planes of `image` allocated from the pool before freeing the
+	// rest of it as usual.
+	void free_image(EXRImage &image)
+	{
+		if (image.images) {
+			for (int c = 0; c < image.num_channels; c++) {
+				if (release(image.images[c])) image.images[c] = nullptr;
+			}
+		}
+		FreeEXRImage(&image);
+	}
+
+	// Unmap the free buffers, returns the number of bytes released.
+	uint64_t trim()
+	{
+		std::lock_guard<std::mutex> lg(mutex);
+		for (auto &list : free_lists) {
+			for (unsigned char *ptr : list.second) {
+				if (allocator) {
+					host_aligned_free(*allocator, ptr);
+				} else {
+					unmap_pages(ptr, list.first.first);
+				}
+			}
+		}
+		free_lists.clear();
+		uint64_t released = free_bytes;
+		free_bytes = 0;
+		return released;
+	}
+};
+
+// Buffer from a `buffer_pool` returned to it when destroyed.
+struct pooled_buffer
+{
+	buffer_pool *pool = nullptr;
+	unsigned char *data = nullptr;
+	size_t size = 0;
+
+	pooled_buffer() { }
+	pooled_buffer(buffer_pool &pool, size_t size, exrtool_buffer_kind kind) : pool(&pool), data(pool.acquire(size, kind)), size(data ? size : 0) { }
+	pooled_buffer(const pooled_buffer&) = delete;
+	pooled_buffer& operator=(const pooled_buffer&) = delete;
+	pooled_buffer(pooled_buffer &&rhs) : pool(rhs.pool), data(rhs.data), size(rhs.size) { rhs.data = nullptr; }
+	pooled_buffer& operator=(pooled_buffer &&rhs)
+	{
+		if (this != &rhs) {
+			reset();
+			pool = rhs.pool;
+			data = rhs.data;
+			size = rhs.size;
+			rhs.data = nullptr;
+		}
+		return *this;
+	}
+	~pooled_buffer() { reset(); }
+
+	void reset()
+	{
+		if (data) pool->release(data);
+		data = nullptr;
+		size = 0;
+	}
+};
+
+// Contents of an input file, either read into `buffer`, possibly bypassing
+// the page cache, or mapped into memory. Tinyexr only ever sees `data` and
+// `size`.
+struct input_file
+{
+	const unsigned char *data = nullptr;
+	size_t size = 0;
+	bool mapped = false;
+
+	pooled_buffer buffer;
+	memory_charge charge;
+
+	input_file() { }
+	input_file(const input_file&) = delete;
+	input_file& operator=(const input_file&) = delete;
+
+	~input_file()
+	{
+		if (!mapped) return;
+#if defined(_WIN32)
+		UnmapViewOfFile(data);
+#else
+		munmap((void*)data, size);
+#endif
+	}
+};
+
+// Input file of a frame read ahead of time by a prefetch thread.
+struct prefetch_slot
+{
+	enum state_t { PENDING, READING, DONE, TAKEN };
+
+	state_t state = PENDING;
+	std::unique_ptr<input_file> file;
+};
+
+struct frame_cost
+{
+	enum state_t { UNKNOWN, PROBING, KNOWN };
+
+	state_t state = UNKNOWN;
+	uint64_t file_bytes = 0;
+	uint64_t decoded_bytes = 0;
+};
+
+struct frame_pipeline;
+
+struct exrtool_run
+{
+	std::vector<std::pair<uint32_t, std::vector<exrtool_run_file>>> frames;
+	std::string output_name;
+	exrtool_input input;
+
+	system_limits limits;
+	// Copy of `input.cpus`.
+	std::vector<int> cpus;
+
+	// Declared before anything holding pooled buffers so that it outlives
+	// them. `start_faults` are the page faults before the run started.
+	buffer_pool buffers;
+	uint64_t start_faults = 0;
+	// Host allocator for tinyexr, null without one.
+	EXRAllocator exr_allocator;
+	const EXRAllocator *image_allocator = nullptr;
+
+	// Indices into `frames` in the order they are started, positions up to
+	// `a_scheduled` are filled, see `scheduled_frame()`.
+	std::vector<size_t> order;
+	std::atomic_size_t a_scheduled;
+
+	// Frame costs probed once when first needed and, for the longest first
+	// schedule, the probed frames not scheduled yet as a max heap of cost and
+	// index. `probe_next` is the next frame a scheduler may probe.
+	std::mutex schedule_mutex;
+	std::condition_variable schedule_cv;
+	std::vector<frame_cost> costs;
+	std::vector<std::pair<uint64_t, size_t>> probed;
+	size_t probe_next = 0;
+	std::chrono::steady_clock::time_point start_time;
+	std::atomic_uint64_t a_makespan_ns;
+	std::atomic_uint64_t a_longest_frame_ns;
+	// Worker time of the pool until the last frame was done.
+	std::atomic_uint64_t a_makespan_worker_ns;
+
+	// Set by `exrtool_cancel()` along with the time since the start.
+	std::atomic_bool a_cancelled;
+	std::atomic_uint64_t a_cancel_ns;
+
+	// Worker count tuning for `auto_threads`: the frame rate of the previous
+	// window and the direction of the last change, guarded by `tune_mutex`.
+	std::mutex tune_mutex;
+	bool tuning = false;
+	std::chrono::steady_clock::time_point tune_start;
+	uint32_t tune_frames = 0;
+	double tune_rate = 0.0;
+	int tune_step = 1;
+
+	// Time spent paused and the prefetched data released by pausing, guarded
+	// by `pause_mutex`.
+	std::mutex pause_mutex;
+	std::chrono::steady_clock::time_point pause_start;
+	uint64_t paused_ns = 0;
+	uint64_t bytes_released = 0;
+
+	std::atomic_uint32_t a_frames_started;
+	std::atomic_uint32_t a_progress;
+	std::atomic_uint32_t a_frames_done;
+
+	std::atomic_uint64_t a_input_bytes;
+	std::atomic_uint64_t a_bytes_read;
+	std::atomic_uint32_t a_files_mapped;
+	std::atomic_uint64_t a_bytes_written;
+	std::atomic_uint64_t a_io_stall_ns;
+	std::atomic_uint64_t a_read_ns;
+	std::atomic_uint64_t a_write_ns;
+	std::atomic_uint32_t a_files_prefetched;
+	std::atomic_uint64_t a_memory_used;
+	std::atomic_uint64_t a_memory_peak;
+
+	// Caps for `read_limit_mbps` and `write_limit_mbps`.
+	token_bucket read_limit;
+	token_bucket write_limit;
+
+	task_pool pool;
+	std::unique_ptr<frame_pipeline> pipeline;
+
+	// Prefetch state indexed by [frame][file], `prefetch_frame` (a position in
+	// `order`) and `prefetch_file` are the next slot for the I/O threads.
+	std::mutex prefetch_mutex;
+	std::condition_variable prefetch_cv;
+	std::vector<std::vector<prefetch_slot>> prefetch;
+	size_t prefetch_frame = 0;
+	size_t prefetch_file = 0;
+	std::vector<std::thread> io_threads;
+
+	// Frames done in `ordered` mode, delivered in order up to `next_delivery`.
+	std::mutex delivery_mutex;
+	std::condition_variable delivery_cv;
+	std::vector<uint8_t> frame_state;
+	size_t next_delivery = 0;
+	size_t reorder_window = 0;
+	std::atomic_uint64_t a_first_frame_ns;
+
+	// Estimated memory use of the frames admitted under `memory_budget`.
+	std::mutex memory_mutex;
+	std::condition_variable memory_cv;
+	uint64_t memory_admitted = 0;
+	uint64_t memory_admitted_peak = 0;
+
+	std::mutex error_mutex;
+	std::vector<std::string> errors;
+
+	bool cancelled() const
+	{
+		return a_cancelled.load(std::memory_order_relaxed);
+	}
+
+	// Called at frame and chunk boundaries: blocks while the run is paused,
+	// returns false once it has been cancelled.
+	bool checkpoint()
+	{
+		pool.park();
+		return !cancelled();
+	}
+
+	// Errors caused by cancelling are not reported.
+	void error(const char *fmt, ...)
+	{
+		if (cancelled()) return;
+		char buf[1024];
+
+		va_list args;
+		va_start(args, fmt);
+		vsnprintf(buf, sizeof(buf), fmt, args);
+		va_end(args);
+
+		std::lock_guard<std::mutex> lg(error_mutex);
+		errors.push_back(buf);
+	}
+
+};
+
+memory_charge::memory_charge(exrtool_run &run, uint64_t size)
+	: run(&run), size(size)
+{
+	uint64_t used = run.a_memory_used.fetch_add(size, std::memory_order_relaxed) + size;
+	uint64_t peak = run.a_memory_peak.load(std::memory_order_relaxed);
+	while (used > peak && !run.a_memory_peak.compare_exchange_weak(peak, used, std::memory_order_relaxed)) { }
+}
+
+void memory_charge::reset()
+{
+	if (run) run->a_memory_used.fetch_sub(size, std::memory_order_relaxed);
+	run = nullptr;
+}
+
+// Wait on `cv` until `pred()` holds, running chunk tasks meanwhile so that a
+// blocked worker still helps the frames in progress.
+template <typename Pred>
+static void wait_helping(exrtool_run &run, std::unique_lock<std::mutex> &lock, std::condition_variable &cv, Pred pred)
+{
+	while (!pred()) {
+		lock.unlock();
+		run.pool.park();
+		bool ran = run.pool.run_chunk_task();
+		lock.lock();
+		if (!ran && !pred()) cv.wait_for(lock, std::chrono::milliseconds(1));
+	}
+}
+
+// Read the whole file with a single open and a single read so that the
+// version, header and pixel data can all be parsed from the same buffer.
+// With a read cap the read is split into throttled slices.
+static bool read_file(exrtool_run &run, const char *name, input_file &file)
+{
+	FILE *f = open_file(name, "rb");
+	if (!f) {
+		run.error("Failed to open file\n%s", name);
+		return false;
+	}
+
+	uint64_t size = 0;
+	bool ok = file_size(f, &size) && size == (size_t)size;
+	if (ok) file.buffer = pooled_buffer(run.buffers, (size_t)size, EXRTOOL_BUFFER_INPUT);
+	ok = ok && file.buffer.data;
+	if (ok) {
+		size_t slice = run.read_limit.limited() ? throttle_slice : (size_t)size;
+		size_t num_read = 0;
+		while (num_read < size) {
+			size_t to_read = std::min((size_t)size - num_read, slice);
+			run.read_limit.consume(to_read, run.a_cancelled);
+			size_t num = fread(file.buffer.data + num_read, 1, to_read, f);
+			num_read += num;
+			if (num < to_read) break;
+		}
+		run.a_bytes_read.fetch_add(num_read, std::memory_order_relaxed);
+		ok = num_read == size;
+	}
+#if defined(POSIX_FADV_DONTNEED)
+	if (run.input.input_cache != EXRTOOL_CACHE_BUFFERED) {
+		posix_fadvise(fileno(f), 0, 0, POSIX_FADV_DONTNEED);
+	}
+#endif
+	fclose(f);
+
+	if (!ok) {
+		run.error("Failed to read file\n%s", name);
+		return false;
+	}
+
+	file.data = file.buffer.data;
+	file.size = (size_t)size;
+	run.a_input_bytes.fetch_add(size, std::memory_order_relaxed);
+	return true;
+}
+
+// Map the whole file read-only. Returns false without reporting an error if
+// the file should be read with `read_file()` instead: if mapping fails or, in
+// `EXRTOOL_READ_AUTO` mode, if the file lives on a network filesystem where
+// page faults turn into small synchronous round trips.
+static bool map_file(exrtool_run &run, const char *name, input_file &file)
+{
+	bool is_auto = run.input.read_mode == EXRTOOL_READ_AUTO;
+
+#if defined(_WIN32)
+	wchar_t wname[1024];
+	if (!widen(name, wname, 1024)) return false;
+
+	if (is_auto) {
+		wchar_t root[1024];
+		if (wname[0] == '\\' && wname[1] == '\\') return false;
+		if (GetVolumePathNameW(wname, root, 1024) && GetDriveTypeW(root) == DRIVE_REMOTE) return false;
+	}
+
+	HANDLE handle = CreateFileW(wname, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(handle, &size) && size.QuadPart > 0 && (uint64_t)size.QuadPart == (size_t)size.QuadPart) {
+		mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	CloseHandle(handle);
+	if (!mapping) return false;
+
+	void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!data) return false;
+
+	file.size = (size_t)size.QuadPart;
+#else
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) return false;
+
+	if (is_auto) {
+		bool remote = false;
+#if defined(__linux__)
+		struct statfs fs;
+		if (fstatfs(fd, &fs) == 0) {
+			switch ((uint32_t)fs.f_type) {
+			case 0x6969u: // NFS
+			case 0x517Bu: // SMB
+			case 0xFF534D42u: // CIFS
+			case 0xFE534D42u: // SMB2
+			case 0x65735546u: // FUSE
+			case 0x01021997u: // 9P
+			case 0x00C36400u: // Ceph
+				remote = true;
+				break;
+			}
+		}
+#elif defined(__APPLE__)
+		struct statfs fs;
+		if (fstatfs(fd, &fs) == 0) remote = (fs.f_flags & MNT_LOCAL) == 0;
+#endif
+		if (remote) {
+			close(fd);
+			return false;
+		}
+	}
+
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size == (size_t)st.st_size) {
+		data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) return false;
+
+	// The decoder walks the chunks front to back, start reading ahead
+	// immediately instead of faulting in page by page.
+	madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+	madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+
+	file.size = (size_t)st.st_size;
+#endif
+
+	file.data = (const unsigned char*)data;
+	file.mapped = true;
+	run.a_files_mapped.fetch_add(1, std::memory_order_relaxed);
+	// Counted as mapped, see `exrtool_stats::bytes_read`.
+	run.a_bytes_read.fetch_add(file.size, std::memory_order_relaxed);
+	run.a_input_bytes.fetch_add(file.size, std::memory_order_relaxed);
+	return true;
+}
+
+// Read the whole file bypassing the page cache into an aligned buffer.
+// Returns false without reporting an error if the file can't be read
+// unbuffered, eg. on filesystems without `O_DIRECT` support.
+static bool read_file_direct(exrtool_run &run, const char *name, input_file &file)
+{
+	uint64_t size = 0;
+	size_t num_read = 0;
+	bool unsupported = false;
+
+#if defined(_WIN32)
+	wchar_t wname[1024];
+	if (!widen(name, wname, 1024)) return false;
+
+	HANDLE handle = CreateFileW(wname, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER li;
+	bool ok = GetFileSizeEx(handle, &li) && (uint64_t)li.QuadPart == (size_t)li.QuadPart;
+	size = ok ? (uint64_t)li.QuadPart : 0;
+	size_t alloc_size = align_up(std::max((size_t)size, (size_t)1), direct_alignment);
+	if (ok) file.buffer = pooled_buffer(run.buffers, alloc_size, EXRTOOL_BUFFER_INPUT);
+	while (file.buffer.data && num_read < size) {
+		DWORD num = 0;
+		DWORD to_read = (DWORD)std::min(alloc_size - num_read, run.read_limit.limited() ? throttle_slice : (size_t)0x40000000);
+		run.read_limit.consume(to_read, run.a_cancelled);
+		if (!ReadFile(handle, file.buffer.data + num_read, to_read, &num, NULL)) {
+			unsupported = num_read == 0 && GetLastError() == ERROR_INVALID_PARAMETER;
+			break;
+		}
+		if (num == 0) break;
+		num_read += num;
+	}
+	CloseHandle(handle);
+#else
+#if defined(O_DIRECT)
+	int fd = open(name, O_RDONLY | O_DIRECT);
+#else
+	int fd = open(name, O_RDONLY);
+#if defined(F_NOCACHE)
+	if (fd >= 0) fcntl(fd, F_NOCACHE, 1);
+#endif
+#endif
+	if (fd < 0) return false;
+
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 && (uint64_t)st.st_size == (size_t)st.st_size;
+	size = ok ? (uint64_t)st.st_size : 0;
+	size_t alloc_size = align_up(std::max((size_t)size, (size_t)1), direct_alignment);
+	if (ok) file.buffer = pooled_buffer(run.buffers, alloc_size, EXRTOOL_BUFFER_INPUT);
+	size_t slice = run.read_limit.limited() ? throttle_slice : alloc_size;
+	while (file.buffer.data && num_read < size) {
+		size_t to_read = std::min(alloc_size - num_read, slice);
+		run.read_limit.consume(to_read, run.a_cancelled);
+		ssize_t num = read(fd, file.buffer.data + num_read, to_read);
+		if (num < 0 && errno == EINTR) continue;
+		if (num < 0) {
+			unsupported = num_read == 0 && errno == EINVAL;
+			break;
+		}
+		if (num == 0) break;
+		num_read += (size_t)num;
+	}
+	close(fd);
+#endif
+
+	if (unsupported || !file.buffer.data) {
+		file.buffer.reset();
+		return false;
+	}
+
+	run.a_bytes_read.fetch_add(num_read, std::memory_order_relaxed);
+	if (num_read < size) {
+		run.error("Failed to read file\n%s", name);
+		return false;
+	}
+
+	file.data = file.buffer.data;
+	file.size = (size_t)size;
+	run.a_input_bytes.fetch_add(size, std::memory_order_relaxed);
+	return true;
+}
+
+static bool open_input(exrtool_run &run, const char *name, input_file &file)
+{
+	auto start = std::chrono::steady_clock::now();
+	bool ok;
+
+	// Mapped files always go through the page cache, so other cache policies
+	// read into buffers instead. Page faults can't be throttled either.
+	exrtool_cache_policy cache = run.input.input_cache;
+	bool can_map = run.input.read_mode != EXRTOOL_READ_BUFFERED && !run.read_limit.limited();
+	if (cache == EXRTOOL_CACHE_BUFFERED && can_map && map_file(run, name, file)) {
+		ok = true;
+	} else if (cache == EXRTOOL_CACHE_DIRECT && read_file_direct(run, name, file)) {
+		ok = true;
+	} else if (file.buffer.data) {
+		// Unbuffered read failed after opening, the error has been reported.
+		ok = false;
+	} else {
+		ok = read_file(run, name, file);
+	}
+	if (ok && !file.mapped) file.charge = memory_charge(run, file.size);
+
+	run.a_read_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+	return ok;
+}
+
+// Touch every page of a mapped file so that it is read in by the calling
+// thread instead of faulting later during decoding.
+static void populate_input(const input_file &file)
+{
+	if (!file.mapped) return;
+	const volatile unsigned char *data = file.data;
+	for (size_t i = 0; i < file.size; i += 4096) {
+		(void)data[i];
+	}
+}
+
+static size_t pixel_size(int pixel_type)
+{
+	return pixel_type == TINYEXR_PIXELTYPE_HALF ? 2 : 4;
+}
+
+// Size of the channels of an image selected by `channel_mask` once decoded.
+static uint64_t decoded_size(const EXRHeader &header, const int *channel_mask)
+{
+	const EXRBox2i &dw = header.data_window;
+	uint64_t pixels = (uint64_t)((int64_t)dw.max_x - dw.min_x + 1) * (uint64_t)((int64_t)dw.max_y - dw.min_y + 1);
+	uint64_t size = 0;
+	for (int i = 0; i < header.num_channels; i++) {
+		if (channel_mask[i]) size += pixels * pixel_size(header.pixel_types[i]);
+	}
+	return size;
+}
+
+// Total size of the input files of frame `ix` and of their decoded channels
+// from the file sizes and headers.
+static frame_cost probe_frame(const exrtool_run &run, size_t ix)
+{
+	frame_cost cost;
+	for (const exrtool_run_file &file : run.frames[ix].second) {
+		const char *name = file.name.c_str();
+		FILE *f = open_file(name, "rb");
+		if (f) {
+			uint64_t size;
+			if (file_size(f, &size)) cost.file_bytes += size;
+			fclose(f);
+		}
+
+		// Unreadable inputs are reported when the frame is processed
+		EXRHeader header;
+		const char *err = nullptr;
+		if (exrtool_probe_header(name, &header, nullptr, &err)) {
+			FreeEXRErrorMessage(err);
+			continue;
+		}
+
+		std::vector<int> channel_mask(header.num_channels);
+		for (int i = 0; i < header.num_channels; i++) {
+			channel_mask[i] = file.use_channel(header.channels[i].name) ? 1 : 0;
+		}
+		cost.decoded_bytes += decoded_size(header, channel_mask.data());
+		FreeEXRHeader(&header);
+	}
+	return cost;
+}
+
+static bool longest_first(const exrtool_run &run)
+{
+	return !run.input.ordered && run.input.schedule == EXRTOOL_SCHEDULE_LONGEST_FIRST;
+}
+
+// Higher cost first, then lower index.
+static bool cost_less(const std::pair<uint64_t, size_t> &lhs, const std::pair<uint64_t, size_t> &rhs)
+{
+	return lhs.first < rhs.first || (lhs.first == rhs.first && lhs.second > rhs.second);
+}
+
+// Probe frame `ix` with `lock` on `schedule_mutex` held, unlocked meanwhile.
+static void probe_cost(exrtool_run &run, std::unique_lock<std::mutex> &lock, size_t ix)
+{
+	run.costs[ix].state = frame_cost::PROBING;
+	lock.unlock();
+	frame_cost cost = probe_frame(run, ix);
+	lock.lock();
+
+	cost.state = frame_cost::KNOWN;
+	run.costs[ix] = cost;
+	if (longest_first(run)) {
+		run.probed.emplace_back(cost.file_bytes + cost.decoded_bytes, ix);
+		std::push_heap(run.probed.begin(), run.probed.end(), cost_less);
+	}
+	run.schedule_cv.notify_all();
+}
+
+// Cost of frame `ix`, probed by the first thread asking for it.
+static frame_cost frame_cost_of(exrtool_run &run, size_t ix)
+{
+	std::unique_lock<std::mutex> lock(run.schedule_mutex);
+	if (run.costs[ix].state == frame_cost::UNKNOWN) probe_cost(run, lock, ix);
+	run.schedule_cv.wait(lock, [&]() { return run.costs[ix].state == frame_cost::KNOWN; });
+	return run.costs[ix];
+}
+
+// Estimate the peak memory use of merging frame `ix`: the input files, their
+// decoded channels and the encoded output when it is built in memory, bounded
+// by the size of the decoded channels.
+static uint64_t estimate_frame_memory(exrtool_run &run, size_t ix)
+{
+	frame_cost cost = frame_cost_of(run, ix);
+	uint64_t total = cost.file_bytes + cost.decoded_bytes;
+	if (run.input.pipeline || run.input.write_mode == EXRTOOL_WRITE_BUFFERED) total += cost.decoded_bytes;
+	return total;
+}
+
+// Set up `run.order`. In frame order every position is filled right away.
+// For `EXRTOOL_SCHEDULE_LONGEST_FIRST` the costs, estimated from the amount
+// of compressed and decoded data which dominate decompression, merging and
+// compression time, are probed in the background on the pool.
+static void schedule_frames(exrtool_run &run)
+{
+	run.order.resize(run.frames.size());
+	run.costs.resize(run.frames.size());
+	if (!longest_first(run)) {
+		for (size_t i = 0; i < run.order.size(); i++) {
+			run.order[i] = i;
+		}
+		run.a_scheduled.store(run.order.size(), std::memory_order_release);
+		return;
+	}
+
+	exrtool_run *self = &run;
+	for (size_t i = 0; i < run.frames.size() && run.pool.size() > 0; i++) {
+		run.pool.spawn([=]() {
+			if (!self->cancelled()) frame_cost_of(*self, i);
+		});
+	}
+}
+
+// Frame at position `pos` of `run.order`. Positions are filled in turn with
+// the costliest frame among the ones probed so far, probing the next one when
+// none is left, so that processing starts before every frame is probed.
+// Frames are no longer probed once the run is cancelled.
+static size_t scheduled_frame(exrtool_run &run, size_t pos)
+{
+	if (pos < run.a_scheduled.load(std::memory_order_acquire)) return run.order[pos];
+
+	std::unique_lock<std::mutex> lock(run.schedule_mutex);
+	for (;;) {
+		size_t next = run.a_scheduled.load(std::memory_order_relaxed);
+		if (pos < next) break;
+
+		size_t ix;
+		if (!run.probed.empty()) {
+			std::pop_heap(run.probed.begin(), run.probed.end(), cost_less);
+			ix = run.probed.back().second;
+			run.probed.pop_back();
+		} else {
+			while (run.probe_next < run.frames.size() && run.costs[run.probe_next].state != frame_cost::UNKNOWN) {
+				run.probe_next++;
+			}
+			if (run.probe_next >= run.frames.size()) {
+				run.schedule_cv.wait(lock);
+				continue;
+			}
+			ix = run.probe_next++;
+			if (!run.cancelled()) {
+				probe_cost(run, lock, ix);
+				continue;
+			}
+			// Skipped anyway, admitted at no cost
+			run.costs[ix].state = frame_cost::KNOWN;
+			run.schedule_cv.notify_all();
+		}
+
+		run.order[next] = ix;
+		run.a_scheduled.store(next + 1, std::memory_order_release);
+	}
+	return run.order[pos];
+}
+
+// Read input files of the frames up to `prefetch_depth` past the last started
+// one in order, while the compute threads decode and encode.
+static void prefetch_inputs(exrtool_run &run)
+{
+	std::unique_lock<std::mutex> lock(run.prefetch_mutex);
+	for (;;) {
+		if (run.prefetch_frame >= run.frames.size() || run.cancelled()) break;
+		if (run.pool.a_paused.load(std::memory_order_relaxed)) {
+			lock.unlock();
+			run.pool.park();
+			lock.lock();
+			continue;
+		}
+
+		size_t limit = run.a_frames_started.load(std::memory_order_relaxed) + run.input.prefetch_depth;
+		if (run.prefetch_frame >= limit) {
+			run.prefetch_cv.wait(lock);
+			continue;
+		}
+
+		// Scheduling may probe headers, pausing may move the window back
+		size_t pos = run.prefetch_frame;
+		lock.unlock();
+		size_t ix = scheduled_frame(run, pos);
+		lock.lock();
+		if (pos != run.prefetch_frame) continue;
+		if (run.prefetch_file >= run.prefetch[ix].size()) {
+			run.prefetch_frame++;
+			run.prefetch_file = 0;
+			continue;
+		}
+
+		size_t file_ix = run.prefetch_file++;
+		prefetch_slot &slot = run.prefetch[ix][file_ix];
+		if (slot.state != prefetch_slot::PENDING) continue;
+		slot.state = prefetch_slot::READING;
+		lock.unlock();
+
+		std::unique_ptr<input_file> file(new input_file());
+		bool ok = open_input(run, run.frames[ix].second[file_ix].name.c_str(), *file);
+		if (ok) {
+			populate_input(*file);
+			run.a_files_prefetched.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		lock.lock();
+		if (ok) slot.file = std::move(file);
+		slot.state = prefetch_slot::DONE;
+		run.prefetch_cv.notify_all();
+	}
+}
+
+// Get the contents of input `file_ix` of frame `ix`, waiting for the prefetch
+// threads or reading it directly. The time spent is accounted as I/O stall.
+// Returns null on failure, the error has already been reported.
+static std::unique_ptr<input_file> acquire_input(exrtool_run &run, size_t ix, size_t file_ix)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::unique_ptr<input_file> file;
+	bool prefetched = false;
+
+	if (run.input.prefetch_depth > 0) {
+		std::unique_lock<std::mutex> lock(run.prefetch_mutex);
+		prefetch_slot &slot = run.prefetch[ix][file_ix];
+		if (slot.state == prefetch_slot::READING || slot.state == prefetch_slot::DONE) {
+			run.prefetch_cv.wait(lock, [&]() { return slot.state == prefetch_slot::DONE; });
+			file = std::move(slot.file);
+			prefetched = true;
+		}
+		slot.state = prefetch_slot::TAKEN;
+	}
+
+	if (!prefetched) {
+		file.reset(new input_file());
+		if (!open_input(run, run.frames[ix].second[file_ix].name.c_str(), *file)) {
+			file.reset();
+		}
+	}
+
+	run.a_io_stall_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+	return file;
+}
+
+static std::vector<unsigned char> encode_u64le(const std::vector<uint64_t> &values)
+{
+	std::vector<unsigned char> bytes(values.size() * 8);
+	for (size_t i = 0; i < values.size(); i++) {
+		for (size_t b = 0; b < 8; b++) {
+			bytes[i * 8 + b] = (unsigned char)(values[i] >> (b * 8));
+		}
+	}
+	return bytes;
+}
+
+// Pointers to the first line of the chunk starting at `y` for each channel.
+static void chunk_lines(const EXRImage *image, const EXRHeader *header, int y, const unsigned char **lines)
+{
+	for (int c = 0; c < header->num_channels; c++) {
+		size_t stride = (size_t)image->width * pixel_size(header->requested_pixel_types[c]);
+		lines[c] = image->images[c] + (size_t)y * stride;
+	}
+}
+
+// Fills `lines` with pointers to `num_lines` lines starting at `y` for each
+// output channel. Returns a TINYEXR_ERROR code.
+typedef std::function<int(int y, int num_lines, const unsigned char **lines, const char **err)> chunk_source;
+
+// Output file supporting positional writes from multiple threads. The time
+// spent in I/O calls is accumulated in `a_io_ns`.
+struct output_file
+{
+#if defined(_WIN32)
+	HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+	int fd = -1;
+#endif
+	std::string path;
+	std::atomic_uint64_t a_io_ns { 0 };
+	// Run whose write cap applies, if any.
+	exrtool_run *run = nullptr;
+
+	output_file() { }
+	output_file(const output_file&) = delete;
+	output_file& operator=(const output_file&) = delete;
+
+	~output_file() { close(); }
+
+	// With `direct` the page cache is bypassed, offsets, sizes and buffers
+	// must then be aligned to `direct_alignment`.
+	bool open(const char *name, bool direct)
+	{
+		auto start = std::chrono::steady_clock::now();
+		path = name;
+#if defined(_WIN32)
+		wchar_t wname[1024];
+		if (!widen(name, wname, 1024)) return false;
+		DWORD flags = direct ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : FILE_ATTRIBUTE_NORMAL;
+		handle = CreateFileW(wname, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, flags, NULL);
+		bool ok = handle != INVALID_HANDLE_VALUE;
+#else
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+		if (direct) flags |= O_DIRECT;
+#endif
+		fd = ::open(name, flags, 0666);
+#if defined(F_NOCACHE)
+		if (direct && fd >= 0) fcntl(fd, F_NOCACHE, 1);
+#endif
+		bool ok = fd >= 0;
+#endif
+		a_io_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+		return ok;
+	}
+
+	// Reserve disk space up front so that concurrent writers don't contend
+	// on extending the file. Only a hint, failure is ignored.
+	void preallocate(uint64_t size)
+	{
+#if defined(_WIN32)
+		FILE_ALLOCATION_INFO info;
+		info.AllocationSize.QuadPart = (LONGLONG)size;
+		SetFileInformationByHandle(handle, FileAllocationInfo, &info, sizeof(info));
+#elif defined(__linux__)
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size);
+#else
+		(void)size;
+#endif
+	}
+
+	// Time spent waiting for the write cap is not counted as I/O.
+	bool write_at(const void *data, size_t size, uint64_t offset)
+	{
+		auto start = std::chrono::steady_clock::now();
+		uint64_t wait_ns = 0;
+		const char *ptr = (const char*)data;
+		bool ok = true;
+		while (ok && size > 0) {
+			size_t to_write = size;
+			if (run && run->write_limit.limited()) {
+				to_write = std::min(size, throttle_slice);
+				auto wait_start = std::chrono::steady_clock::now();
+				run->write_limit.consume(to_write, run->a_cancelled);
+				wait_ns += elapsed_ns(wait_start);
+			}
+#if defined(_WIN32)
+			OVERLAPPED ov = { };
+			ov.Offset = (DWORD)offset;
+			ov.OffsetHigh = (DWORD)(offset >> 32);
+			DWORD num = 0;
+			to_write = std::min(to_write, (size_t)0x40000000);
+			ok = WriteFile(handle, ptr, (DWORD)to_write, &num, &ov) && num > 0;
+#else
+			ssize_t num = pwrite(fd, ptr, to_write, (off_t)offset);
+			if (num < 0 && errno == EINTR) continue;
+			ok = num > 0;
+#endif
+			if (!ok) break;
+			ptr += num;
+			size -= (size_t)num;
+			offset += (uint64_t)num;
+		}
+		a_io_ns.fetch_add(elapsed_ns(start) - wait_ns, std::memory_order_relaxed);
+		return ok;
+	}
+
+	// Set the final size, releasing any preallocated space past it.
+	bool truncate(uint64_t size)
+	{
+		auto start = std::chrono::steady_clock::now();
+#if defined(_WIN32)
+		LARGE_INTEGER pos;
+		pos.QuadPart = (LONGLONG)size;
+		bool ok = SetFilePointerEx(handle, pos, NULL, FILE_BEGIN) && SetEndOfFile(handle);
+#else
+		bool ok = ftruncate(fd, (off_t)size) == 0;
+#endif
+		a_io_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+		return ok;
+	}
+
+	// Write back the file contents and drop them from the page cache. There
+	// is no per-file equivalent on Windows, the data stays cached there.
+	bool drop_cache()
+	{
+		bool ok = true;
+#if !defined(_WIN32)
+		auto start = std::chrono::steady_clock::now();
+#if defined(__APPLE__)
+		ok = fsync(fd) == 0;
+#else
+		ok = fdatasync(fd) == 0;
+#endif
+#if defined(POSIX_FADV_DONTNEED)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+		a_io_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+#endif
+		return ok;
+	}
+
+	bool close()
+	{
+		auto start = std::chrono::steady_clock::now();
+		bool ok = true;
+#if defined(_WIN32)
+		if (handle != INVALID_HANDLE_VALUE) ok = CloseHandle(handle) != 0;
+		handle = INVALID_HANDLE_VALUE;
+#else
+		if (fd >= 0) ok = ::close(fd) == 0;
+		fd = -1;
+#endif
+		a_io_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+		return ok;
+	}
+
+	// Close and delete a partially written file.
+	void discard()
+	{
+#if defined(_WIN32)
+		bool opened = handle != INVALID_HANDLE_VALUE;
+#else
+		bool opened = fd >= 0;
+#endif
+		if (!opened) return;
+		close();
+#if defined(_WIN32)
+		wchar_t wname[1024];
+		if (widen(path.c_str(), wname, 1024)) DeleteFileW(wname);
+#else
+		unlink(path.c_str());
+#endif
+	}
+};
+
+// Output file written front to back, except for the first `head_size` bytes
+// which are passed to `finish()` once everything else is known. Applies the
+// output cache policy: with `EXRTOOL_CACHE_DIRECT` writes are collected in an
+// aligned staging buffer and written unbuffered in large aligned blocks.
+struct stream_output
+{
+	output_file out;
+	exrtool_cache_policy cache = EXRTOOL_CACHE_BUFFERED;
+	size_t head_size = 0;
+	uint64_t size = 0;
+
+	// `stage` holds the file contents starting from `stage_offset`, the first
+	// aligned block containing the head is saved to `first_block` before it
+	// is written so that it can be rewritten with the real head. Comes from
+	// the buffer pool of `out.run`.
+	unsigned char *stage = nullptr;
+	size_t stage_size = 0;
+	size_t stage_fill = 0;
+	uint64_t stage_offset = 0;
+	std::vector<unsigned char> first_block;
+
+	~stream_output()
+	{
+		if (stage) out.run->buffers.release(stage);
+	}
+
+	bool open(const char *name, exrtool_cache_policy policy, size_t head)
+	{
+		cache = policy;
+		head_size = head;
+		size = head;
+
+		if (cache == EXRTOOL_CACHE_DIRECT) {
+			stage_size = std::max((size_t)1 << 20, align_up(head, direct_alignment) * 2);
+			stage = out.run->buffers.acquire(stage_size, EXRTOOL_BUFFER_CHUNK);
+			if (stage && out.open(name, true)) {
+				memset(stage, 0, head);
+				stage_fill = head;
+				return true;
+			}
+
+			// Unbuffered I/O is not supported everywhere, eg. on tmpfs
+			if (stage) out.run->buffers.release(stage);
+			stage = nullptr;
+			cache = EXRTOOL_CACHE_DONTNEED;
+		}
+
+		return out.open(name, false);
+	}
+
+	bool write(const void *data, size_t num)
+	{
+		if (!stage) {
+			bool ok = out.write_at(data, num, size);
+			size += num;
+			return ok;
+		}
+
+		const unsigned char *src = (const unsigned char*)data;
+		size += num;
+		while (num > 0) {
+			size_t n = std::min(num, stage_size - stage_fill);
+			memcpy(stage + stage_fill, src, n);
+			stage_fill += n;
+			src += n;
+			num -= n;
+
+			if (stage_fill == stage_size) {
+				if (stage_offset == 0) {
+					first_block.assign(stage, stage + align_up(head_size, direct_alignment));
+				}
+				if (!out.write_at(stage, stage_size, stage_offset)) return false;
+				stage_offset += stage_size;
+				stage_fill = 0;
+			}
+		}
+		return true;
+	}
+
+	bool finish(const void *head)
+	{
+		bool ok = true;
+		if (!stage) {
+			ok = out.write_at(head, head_size, 0);
+			if (cache == EXRTOOL_CACHE_DONTNEED) ok = ok && out.drop_cache();
+		} else {
+			if (stage_offset == 0) memcpy(stage, head, head_size);
+
+			size_t tail = align_up(stage_fill, direct_alignment);
+			memset(stage + stage_fill, 0, tail - stage_fill);
+			ok = out.write_at(stage, tail, stage_offset);
+
+			if (ok && stage_offset > 0) {
+				memcpy(stage, first_block.data(), first_block.size());
+				memcpy(stage, head, head_size);
+				ok = out.write_at(stage, first_block.size(), 0);
+			}
+			ok = ok && out.truncate(size);
+		}
+		return out.close() && ok;
+	}
+};
+
+// Save a scanline image `window` chunks at a time: the chunks are encoded
+// concurrently and written in order as soon as they are done, finally the
+// header and offset table are written in front of them. Only `window` encoded
+// chunks are held in memory at a time and the pixels are requested from
+// `source` chunk by chunk, `source` is always called from the calling thread
+// and its lines must stay valid for `window` calls. The output is identical
+// to `SaveEXRImageToFile()`.
+static int save_exr_stream(exrtool_run &run, const EXRHeader *header, int width, int height, const chunk_source &source, size_t window, const char *name, const char **err)
+{
+	unsigned char *header_data = nullptr;
+	size_t header_size = SaveEXRHeaderToMemory(header, width, height, &header_data, err);
+	if (header_size == 0) return TINYEXR_ERROR_SERIALZATION_FAILED;
+
+	int lines_per_chunk = EXRNumScanlinesPerChunk(header->compression_type);
+	int num_chunks = (height + lines_per_chunk - 1) / lines_per_chunk;
+	std::vector<uint64_t> offsets(num_chunks);
+	size_t table_end = header_size + offsets.size() * 8;
+
+	stream_output out;
+	out.out.run = &run;
+	if (!out.open(name, run.input.output_cache, table_end)) {
+		free(header_data);
+		set_error(err, "Failed to open output file");
+		return TINYEXR_ERROR_CANT_WRITE_FILE;
+	}
+
+	window = std::max(std::min(window, (size_t)num_chunks), (size_t)1);
+	size_t bound = EXRScanlineChunkBound(header, width, lines_per_chunk);
+	std::vector<pooled_buffer> chunks(window);
+	for (pooled_buffer &chunk : chunks) {
+		chunk = pooled_buffer(run.buffers, bound, EXRTOOL_BUFFER_CHUNK);
+		if (!chunk.data) {
+			out.out.discard();
+			free(header_data);
+			set_error(err, "Failed to allocate chunk buffer");
+			return TINYEXR_ERROR_SERIALZATION_FAILED;
+		}
+	}
+	std::vector<std::vector<const unsigned char*>> lines(window, std::vector<const unsigned char*>(header->num_channels));
+	std::vector<size_t> sizes(window);
+	std::vector<const char*> errors(window);
+	int ret = TINYEXR_SUCCESS;
+	bool ok = true;
+
+	for (int first = 0; ok && ret == TINYEXR_SUCCESS && first < num_chunks; first += (int)window) {
+		if (!run.checkpoint()) {
+			set_error(err, "Cancelled");
+			ret = error_cancelled;
+			break;
+		}
+
+		size_t count = std::min(window, (size_t)(num_chunks - first));
+		for (size_t k = 0; k < count; k++) {
+			int y = (first + (int)k) * lines_per_chunk;
+			ret = source(y, std::min(lines_per_chunk, height - y), lines[k].data(), err);
+			if (ret != TINYEXR_SUCCESS) break;
+		}
+		if (ret != TINYEXR_SUCCESS) break;
+
+		parallel_for(run.pool, count, count, [&](size_t k) {
+			int y = (first + (int)k) * lines_per_chunk;
+			errors[k] = nullptr;
+			sizes[k] = EncodeEXRScanlineChunk(chunks[k].data, chunks[k].size, header,
+				lines[k].data(), width, y, std::min(lines_per_chunk, height - y), &errors[k]);
+		});
+
+		for (size_t k = 0; k < count; k++) {
+			if (sizes[k] == 0 && ret == TINYEXR_SUCCESS) {
+				ret = TINYEXR_ERROR_SERIALZATION_FAILED;
+				if (err) *err = errors[k];
+				errors[k] = nullptr;
+			}
+			if (errors[k]) FreeEXRErrorMessage(errors[k]);
+			if (ret != TINYEXR_SUCCESS || !ok) continue;
+
+			offsets[first + k] = out.size;
+			ok = out.write(chunks[k].data, sizes[k]);
+		}
+	}
+
+	if (ret == TINYEXR_SUCCESS && ok) {
+		std::vector<unsigned char> head(header_data, header_data + header_size);
+		std::vector<unsigned char> table = encode_u64le(offsets);
+		head.insert(head.end(), table.begin(), table.end());
+		ok = out.finish(head.data());
+	}
+	if (ret != TINYEXR_SUCCESS || !ok) out.out.discard();
+	free(header_data);
+
+	if (ret == TINYEXR_SUCCESS && !ok) {
+		set_error(err, "Failed to write output file");
+		ret = TINYEXR_ERROR_CANT_WRITE_FILE;
+	}
+	if (ret == TINYEXR_SUCCESS) {
+		run.a_bytes_written.fetch_add(out.size, std::memory_order_relaxed);
+	}
+	run.a_write_ns.fetch_add(out.out.a_io_ns.load(), std::memory_order_relaxed);
+
+	return ret;
+}
+
+// Write a file encoded in memory with a single write.
+static int write_output(exrtool_run &run, const char *name, const unsigned char *data, size_t size, const char **err)
+{
+	stream_output out;
+	out.out.run = &run;
+	bool ok = out.open(name, run.input.output_cache, 0);
+	ok = ok && out.write(data, size);
+	ok = ok && out.finish(nullptr);
+	if (!ok) out.out.discard();
+
+	run.a_write_ns.fetch_add(out.out.a_io_ns.load(), std::memory_order_relaxed);
+	if (!ok) {
+		set_error(err, "Failed to write output file");
+		return TINYEXR_ERROR_CANT_WRITE_FILE;
+	}
+
+	run.a_bytes_written.fetch_add(size, std::memory_order_relaxed);
+	return TINYEXR_SUCCESS;
+}
+
+// Encode the whole image in memory and write it with a single write.
+static int save_exr_buffered(exrtool_run &run, const EXRImage *image, const EXRHeader *header, const char *name, const char **err)
+{
+	// Encoded in one call, so cancelling is only checked before
+	if (!run.checkpoint()) {
+		set_error(err, "Cancelled");
+		return error_cancelled;
+	}
+
+	unsigned char *data = nullptr;
+	size_t size = SaveEXRImageToMemory(image, header, &data, err);
+	if (size == 0) return TINYEXR_ERROR_SERIALZATION_FAILED;
+	memory_charge charge(run, size);
+
+	int ret = write_output(run, name, data, size, err);
+	exr_free(image->allocator, data);
+	return ret;
+}
+
+// Save a scanline image encoding chunks on multiple pool tasks. Each task
+// claims the next unencoded chunk, encodes it and reserves space for it by
+// bumping a shared file cursor, then writes it directly at that offset.
+// Chunks end up in the file in completion order which is fine as readers
+// locate them through the offset table, written once every chunk is placed.
+// Unbuffered output would need every chunk padded to the alignment, so
+// `EXRTOOL_CACHE_DIRECT` drops the written data from the cache instead.
+static int save_exr_parallel(exrtool_run &run, const EXRImage *image, const EXRHeader *header, const char *name, const char **err)
+{
+	unsigned char *header_data = nullptr;
+	size_t header_size = SaveEXRHeaderToMemory(header, image->width, image->height, &header_data, err);
+	if (header_size == 0) return TINYEXR_ERROR_SERIALZATION_FAILED;
+
+	output_file out;
+	out.run = &run;
+	if (!out.open(name, false)) {
+		free(header_data);
+		set_error(err, "Failed to open output file");
+		return TINYEXR_ERROR_CANT_WRITE_FILE;
+	}
+
+	int lines_per_chunk = EXRNumScanlinesPerChunk(header->compression_type);
+	int num_chunks = (image->height + lines_per_chunk - 1) / lines_per_chunk;
+	std::vector<uint64_t> offsets(num_chunks);
+	uint64_t table_end = header_size + offsets.size() * 8;
+
+	// Compressed output is usually smaller than the raw pixels, any excess
+	// is trimmed by the final truncate.
+	uint64_t raw_size = 0;
+	for (int c = 0; c < header->num_channels; c++) {
+		raw_size += (uint64_t)image->width * image->height * pixel_size(header->requested_pixel_types[c]);
+	}
+	out.preallocate(table_end + raw_size + (uint64_t)num_chunks * 8);
+
+	bool ok = out.write_at(header_data, header_size, 0);
+	free(header_data);
+
+	std::atomic_int a_next_chunk(0);
+	std::atomic_uint64_t a_cursor(table_end);
+	std::atomic_bool a_failed(!ok);
+	std::mutex error_mutex;
+	const char *encode_err = nullptr;
+	int ret = ok ? TINYEXR_SUCCESS : TINYEXR_ERROR_CANT_WRITE_FILE;
+
+	auto worker = [&]() {
+		pooled_buffer chunk(run.buffers, EXRScanlineChunkBound(header, image->width, lines_per_chunk), EXRTOOL_BUFFER_CHUNK);
+		std::vector<const unsigned char*> lines(header->num_channels);
+		if (!chunk.data) {
+			std::lock_guard<std::mutex> lg(error_mutex);
+			if (!a_failed.exchange(true)) {
+				ret = TINYEXR_ERROR_SERIALZATION_FAILED;
+				set_error(&encode_err, "Failed to allocate chunk buffer");
+			}
+		}
+
+		while (!a_failed.load(std::memory_order_relaxed)) {
+			int i = a_next_chunk.fetch_add(1, std::memory_order_relaxed);
+			if (i >= num_chunks) break;
+
+			if (!run.checkpoint()) {
+				std::lock_guard<std::mutex> lg(error_mutex);
+				if (!a_failed.exchange(true)) ret = error_cancelled;
+				break;
+			}
+
+			int y = i * lines_per_chunk;
+			int num_lines = std::min(lines_per_chunk, image->height - y);
+			chunk_lines(image, header, y, lines.data());
+
+			const char *chunk_err = nullptr;
+			size_t size = EncodeEXRScanlineChunk(chunk.data, chunk.size, header,
+				lines.data(), image->width, y, num_lines, &chunk_err);
+			uint64_t offset = size > 0 ? a_cursor.fetch_add(size, std::memory_order_relaxed) : 0;
+			if (size == 0 || !out.write_at(chunk.data, size, offset)) {
+				std::lock_guard<std::mutex> lg(error_mutex);
+				if (!a_failed.exchange(true)) {
+					ret = size == 0 ? TINYEXR_ERROR_SERIALZATION_FAILED : TINYEXR_ERROR_CANT_WRITE_FILE;
+					encode_err = chunk_err;
+					chunk_err = nullptr;
+				}
+				if (chunk_err) FreeEXRErrorMessage(chunk_err);
+				break;
+			}
+			offsets[i] = offset;
+		}
+	};
+
+	size_t num_tasks = run.input.num_write_threads;
+	if (num_tasks == 0) num_tasks = run.pool.size();
+	parallel_for(run.pool, num_tasks, num_tasks, [&](size_t) { worker(); });
+
+	uint64_t end = a_cursor.load();
+	if (ret == TINYEXR_SUCCESS) {
+		std::vector<unsigned char> table = encode_u64le(offsets);
+		ok = out.write_at(table.data(), table.size(), header_size);
+		ok = ok && out.truncate(end);
+		if (run.input.output_cache != EXRTOOL_CACHE_BUFFERED) ok = ok && out.drop_cache();
+	}
+	if (ret == TINYEXR_SUCCESS && ok) {
+		ok = out.close();
+	} else {
+		out.discard();
+	}
+	run.a_write_ns.fetch_add(out.a_io_ns.load(), std::memory_order_relaxed);
+
+	if (ret == TINYEXR_SUCCESS && !ok) ret = TINYEXR_ERROR_CANT_WRITE_FILE;
+	if (ret == error_cancelled) {
+		set_error(err, "Cancelled");
+	} else if (ret == TINYEXR_ERROR_CANT_WRITE_FILE && !encode_err) {
+		set_error(err, "Failed to write output file");
+	} else if (encode_err) {
+		if (err) *err = encode_err;
+		else FreeEXRErrorMessage(encode_err);
+	} else if (ret != TINYEXR_SUCCESS) {
+		set_error(err, "Failed to encode chunk");
+	}
+	if (ret == TINYEXR_SUCCESS) {
+		run.a_bytes_written.fetch_add(end, std::memory_order_relaxed);
+	}
+
+	return ret;
+}
+
+// Number of chunks to encode concurrently per frame. Once there are enough
+// frames to keep every worker busy chunks are encoded one by one, keeping the
+// encoded chunk memory per frame constant.
+static size_t encode_window(const exrtool_run &run)
+{
+	size_t workers = std::max(run.pool.size(), (size_t)1);
+	size_t frames = std::max(std::min(run.frames.size(), workers), (size_t)1);
+	return workers / frames;
+}
+
+// Number of tasks to read and decode the input files of frame `ix` on. While
+// there are enough frames left to keep every worker busy each frame decodes
+// its files in order, towards the end of the job and for jobs with fewer
+// frames than workers the idle workers are spread over the files.
+static size_t file_tasks(const exrtool_run &run, size_t ix)
+{
+	size_t workers = std::max(run.pool.size(), (size_t)1);
+	size_t frames_left = std::max(std::min(run.frames.size() - ix, workers), (size_t)1);
+	return workers / frames_left;
+}
+
+// Decode the channels of an image selected by `channel_mask`. Scanline images
+// are decoded chunk by chunk on the pool, anything else with one tinyexr call.
+static int load_image(exrtool_run &run, EXRImage *image, EXRHeader *header, const int *channel_mask, const unsigned char *data, size_t size, const char **err)
+{
+	const EXRBox2i &dw = header->data_window;
+	int64_t width = (int64_t)dw.max_x - dw.min_x + 1;
+	int64_t height = (int64_t)dw.max_y - dw.min_y + 1;
+	// Same sanity limit as tinyexr, which reports the error
+	const int64_t max_dimension = 1024 * 8192;
+	if (header->tiled || header->line_order != 0 || width <= 0 || height <= 0
+		|| width > max_dimension || height > max_dimension) {
+		return LoadEXRImageChannelsFromMemory(image, header, channel_mask, data, size, err);
+	}
+
+	image->width = (int)width;
+	image->height = (int)height;
+	image->num_channels = header->num_channels;
+	image->images = (unsigned char**)exr_malloc(image->allocator, header->num_channels * sizeof(unsigned char*), TINYEXR_ALLOCATION_IMAGE);
+	if (!image->images) {
+		set_error(err, "Failed to allocate image");
+		return TINYEXR_ERROR_INVALID_DATA;
+	}
+	memset(image->images, 0, header->num_channels * sizeof(unsigned char*));
+
+	bool any_channel = false;
+	for (int c = 0; c < header->num_channels; c++) {
+		if (!channel_mask[c]) continue;
+		image->images[c] = run.buffers.acquire((size_t)width * height * pixel_size(header->requested_pixel_types[c]), EXRTOOL_BUFFER_IMAGE);
+		if (!image->images[c]) {
+			run.buffers.free_image(*image);
+			InitEXRImage(image);
+			set_error(err, "Failed to allocate image");
+			return TINYEXR_ERROR_INVALID_DATA;
+		}
+		any_channel = true;
+	}
+
+	int lines_per_chunk = EXRNumScanlinesPerChunk(header->compression_type);
+	size_t num_chunks = any_channel ? (size_t)((height + lines_per_chunk - 1) / lines_per_chunk) : 0;
+
+	std::mutex error_mutex;
+	int ret = TINYEXR_SUCCESS;
+
+	parallel_for(run.pool, num_chunks, num_chunks, [&](size_t i) {
+		std::vector<unsigned char*> planes(header->num_channels);
+		size_t y = i * lines_per_chunk;
+		for (int c = 0; c < header->num_channels; c++) {
+			if (!image->images[c]) continue;
+			planes[c] = image->images[c] + y * (size_t)width * pixel_size(header->requested_pixel_types[c]);
+		}
+
+		int num_lines;
+		const char *chunk_err = nullptr;
+		int chunk_ret = error_cancelled;
+		if (run.checkpoint()) {
+			chunk_ret = DecodeEXRScanlineChunkFromMemory(planes.data(), &num_lines, header, data, size, (int)i, &chunk_err);
+		} else {
+			set_error(&chunk_err, "Cancelled");
+		}
+		if (chunk_ret) {
+			std::lock_guard<std::mutex> lg(error_mutex);
+			if (ret == TINYEXR_SUCCESS) {
+				ret = chunk_ret;
+				if (err) *err = chunk_err;
+				chunk_err = nullptr;
+			}
+			if (chunk_err) FreeEXRErrorMessage(chunk_err);
+		}
+	});
+
+	if (ret) {
+		run.buffers.free_image(*image);
+		InitEXRImage(image);
+	}
+	return ret;
+}
+
+static std::string output_path(const exrtool_run &run, uint32_t frame)
+{
+	std::string name = run.output_name;
+	size_t end = name.find_last_of('#');
+	if (frame != ~0u && end != std::string::npos) {
+		size_t begin = end;
+		while (begin > 0 && name[begin - 1] == '#') begin--;
+
+		size_t num = end - begin + 1;
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%0*u", (int)num, frame);
+		name.replace(begin, num, buf);
+	}
+	return name;
+}
+
+// Input of a block merged frame along with the currently decoded chunk.
+struct block_input
+{
+	std::unique_ptr<input_file> file;
+	EXRHeader header;
+	bool header_valid = false;
+	int width = 0, height = 0;
+
+	int lines_per_chunk = 0;
+	int chunk = -1;
+	int chunk_lines = 0;
+	pooled_buffer buffer;
+	memory_charge charge;
+	std::vector<unsigned char*> planes;
+
+	~block_input()
+	{
+		if (header_valid) FreeEXRHeader(&header);
+	}
+};
+
+// Output channel of a block merged frame and where it comes from.
+struct block_channel
+{
+	EXRChannelInfo info;
+	size_t input;
+	int channel;
+	size_t stride;
+};
+
+// Merge a frame one output chunk at a time: for each output chunk only the
+// input chunks covering it are decoded, the merged lines are encoded and
+// written immediately. Memory use is bounded by one chunk per input instead
+// of whole images. Sets `fallback` without reporting an error if some input
+// is not a single-part increasing Y scanline image of the same resolution,
+// handing the inputs read so far over in `acquired` indexed by file.
+static bool process_frame_blocks(exrtool_run &run, size_t ix, bool &fallback, std::vector<std::unique_ptr<input_file>> &acquired)
+{
+	uint32_t frame = run.frames[ix].first;
+	const std::vector<exrtool_run_file> &files = run.frames[ix].second;
+
+	std::vector<std::unique_ptr<block_input>> inputs;
+	std::vector<block_channel> channels;
+
+	for (size_t file_ix = 0; file_ix < files.size(); file_ix++) {
+		const exrtool_run_file &file = files[file_ix];
+		int ret;
+		const char *err = nullptr;
+		EXRVersion version;
+
+		inputs.emplace_back(new block_input());
+		block_input &input = *inputs.back();
+		input.file = acquire_input(run, ix, file_ix);
+		if (!input.file) return false;
+
+		ret = ParseEXRVersionFromMemory(&version, input.file->data, input.file->size);
+		if (ret) {
+			run.error("Failed to parse EXR version\n%s", file.name.c_str());
+			return false;
+		}
+
+		InitEXRHeader(&input.header);
+		ret = ParseEXRHeaderFromMemory(&input.header, &version, input.file->data, input.file->size, &err);
+		if (ret) {
+			run.error("Failed to parse EXR header\n%s\n%s", file.name.c_str(), err);
+			FreeEXRErrorMessage(err);
+			return false;
+		}
+		input.header_valid = true;
+
+		const EXRHeader &header = input.header;
+		input.width = header.data_window.max_x - header.data_window.min_x + 1;
+		input.height = header.data_window.max_y - header.data_window.min_y + 1;
+		if (version.multipart || header.tiled || header.line_order != 0
+			|| input.width != inputs[0]->width || input.height != inputs[0]->height) {
+			fallback = true;
+			for (size_t i = 0; i < inputs.size(); i++) {
+				acquired[i] = std::move(inputs[i]->file);
+			}
+			return false;
+		}
+
+		input.lines_per_chunk = EXRNumScanlinesPerChunk(header.compression_type);
+		input.planes.resize(header.num_channels);
+
+		size_t size = 0;
+		for (int i = 0; i < header.num_channels; i++) {
+			EXRChannelInfo &chan = header.channels[i];
+			if (!file.use_channel(chan.name)) continue;
+
+			size_t stride = (size_t)input.width * pixel_size(header.requested_pixel_types[i]);
+			block_channel channel = { chan, inputs.size() - 1, i, stride };
+
+			auto it = std::lower_bound(channels.begin(), channels.end(), channel,
+				[](const block_channel &lhs, const block_channel &rhs) {
+				return strcmp(lhs.info.name, rhs.info.name) < 0;
+			});
+
+			if (it != channels.end() && !strcmp(it->info.name, chan.name)) {
+				*it = channel;
+			} else {
+				channels.insert(it, channel);
+			}
+
+			size += stride * input.lines_per_chunk;
+		}
+
+		input.buffer = pooled_buffer(run.buffers, size, EXRTOOL_BUFFER_IMAGE);
+		if (!input.buffer.data) {
+			run.error("Failed to allocate chunk buffer\n%s", file.name.c_str());
+			return false;
+		}
+		input.charge = memory_charge(run, size);
+		size_t offset = 0;
+		for (int i = 0; i < header.num_channels; i++) {
+			if (!file.use_channel(header.channels[i].name)) continue;
+			input.planes[i] = input.buffer.data + offset;
+			offset += (size_t)input.width * input.lines_per_chunk * pixel_size(header.requested_pixel_types[i]);
+		}
+	}
+
+	run.a_progress.fetch_add((uint32_t)files.size(), std::memory_order_relaxed);
+
+	if (channels.size() == 0) {
+		run.error("Frame %u has no channels", frame);
+		return false;
+	}
+
+	EXRHeader header = inputs[0]->header;
+	int width = inputs[0]->width, height = inputs[0]->height;
+
+	std::vector<EXRChannelInfo> channel_infos;
+	std::vector<int> channel_types;
+	for (block_channel &chan : channels) {
+		channel_infos.push_back(chan.info);
+		channel_types.push_back(chan.info.pixel_type);
+	}
+
+	header.channels = channel_infos.data();
+	header.pixel_types = channel_types.data();
+	header.requested_pixel_types = channel_types.data();
+	header.num_channels = (int)channels.size();
+
+	// Output channels by input, so that every input chunk is decoded once
+	// for all of its channels.
+	std::vector<std::vector<size_t>> input_channels(inputs.size());
+	for (size_t c = 0; c < channels.size(); c++) {
+		input_channels[channels[c].input].push_back(c);
+	}
+
+	// Lines of an output chunk that span multiple input chunks are gathered
+	// here, otherwise the lines are used directly from the decoded input.
+	int out_lines = EXRNumScanlinesPerChunk(header.compression_type);
+	std::vector<pooled_buffer> gathered(channels.size());
+	std::vector<memory_charge> gathered_charges(channels.size());
+
+	std::string name = output_path(run, frame);
+	const char *err = nullptr;
+
+	int ret = save_exr_stream(run, &header, width, height,
+		[&](int y, int num_lines, const unsigned char **lines, const char **err) {
+		for (size_t i = 0; i < inputs.size(); i++) {
+			block_input &input = *inputs[i];
+			if (input_channels[i].empty()) continue;
+
+			for (int line = y; line < y + num_lines; ) {
+				int chunk = line / input.lines_per_chunk;
+				if (chunk != input.chunk) {
+					int ret = DecodeEXRScanlineChunkFromMemory(input.planes.data(), &input.chunk_lines,
+						&input.header, input.file->data, input.file->size, chunk, err);
+					if (ret) return ret;
+					input.chunk = chunk;
+				}
+
+				int chunk_y = chunk * input.lines_per_chunk;
+				int count = std::min(y + num_lines, chunk_y + input.chunk_lines) - line;
+
+				for (size_t c : input_channels[i]) {
+					const block_channel &chan = channels[c];
+					const unsigned char *src = input.planes[chan.channel] + (size_t)(line - chunk_y) * chan.stride;
+
+					if (line == y && count == num_lines) {
+						lines[c] = src;
+					} else {
+						pooled_buffer &dst = gathered[c];
+						if (!dst.data) {
+							size_t size = chan.stride * out_lines;
+							dst = pooled_buffer(run.buffers, size, EXRTOOL_BUFFER_IMAGE);
+							if (!dst.data) {
+								set_error(err, "Failed to allocate gather buffer");
+								return TINYEXR_ERROR_SERIALZATION_FAILED;
+							}
+							gathered_charges[c] = memory_charge(run, size);
+						}
+						memcpy(dst.data + (size_t)(line - y) * chan.stride, src, (size_t)count * chan.stride);
+						lines[c] = dst.data;
+					}
+				}
+				line += count;
+			}
+		}
+		return TINYEXR_SUCCESS;
+	}, 1, name.c_str(), &err);
+
+	if (ret) {
+		run.error("Failed to save EXR image\n%s\n%s", name.c_str(), err);
+		FreeEXRErrorMessage(err);
+		return false;
+	}
+
+	return true;
+}
+
+static size_t default_num_threads(const exrtool_run &run)
+{
+	size_t cores = run.limits.usable_cpus();
+	return cores > 2 ? cores - 2 : 1;
+}
+
+// Hill climb the worker count towards the best frame rate. The rate is
+// measured over windows of at least a frame per worker, after each window
+// the count moves one step, turning around when the rate got worse.
+static void tune_threads(exrtool_run &run, uint32_t done)
+{
+	std::unique_lock<std::mutex> lock(run.tune_mutex, std::try_to_lock);
+	if (!lock.owns_lock() || !run.tuning) return;
+
+	size_t workers = run.pool.size();
+	uint32_t frames = done - run.tune_frames;
+	if (frames < std::max(workers, (size_t)2)) return;
+
+	double rate = (double)frames / ((double)elapsed_ns(run.tune_start) * 1e-9);
+	// Small differences are noise, keep going in the same direction
+	if (rate < run.tune_rate * 0.97) run.tune_step = -run.tune_step;
+	run.tune_rate = rate;
+
+	size_t max_workers = run.limits.usable_cpus() * 2;
+	size_t next = (size_t)std::max((int64_t)workers + run.tune_step, (int64_t)1);
+	run.pool.resize(std::min(next, max_workers));
+
+	run.tune_start = std::chrono::steady_clock::now();
+	run.tune_frames = done;
+}
+
+// Report frame `ix` as done to the callbacks, the first and last ones set
+// the time to first frame and the makespan of the run.
+static void deliver_frame(exrtool_run &run, size_t ix, bool ok)
+{
+	uint32_t done = run.a_frames_done.fetch_add(1, std::memory_order_acq_rel) + 1;
+	if (done == 1) {
+		run.a_first_frame_ns.store(elapsed_ns(run.start_time), std::memory_order_relaxed);
+	}
+	if (done == run.frames.size()) {
+		run.a_makespan_worker_ns.store(run.pool.worker_time_ns(), std::memory_order_relaxed);
+		run.a_makespan_ns.store(elapsed_ns(run.start_time), std::memory_order_relaxed);
+	}
+	if (run.input.auto_threads) tune_threads(run, done);
+
+	if (run.input.frame_fn) {
+		uint32_t frame = run.frames[ix].first;
+		std::string name = output_path(run, frame);
+		run.input.frame_fn(&run, frame, name.c_str(), ok, run.input.frame_user);
+	}
+	if (run.input.progress_fn) {
+		run.input.progress_fn(&run, run.input.progress_user);
+	}
+}
+
+// Frame `ix` has been written or has failed. In `ordered` mode it is held
+// back until every earlier frame is done, the callbacks are called under the
+// delivery lock so that they observe the frames in order.
+static void complete_frame(exrtool_run &run, size_t ix, bool ok)
+{
+	if (!run.input.ordered) {
+		deliver_frame(run, ix, ok);
+		return;
+	}
+
+	enum { PENDING, FAILED, WRITTEN };
+	std::lock_guard<std::mutex> lg(run.delivery_mutex);
+	run.frame_state[ix] = ok ? WRITTEN : FAILED;
+	while (run.next_delivery < run.frames.size() && run.frame_state[run.next_delivery] != PENDING) {
+		size_t next = run.next_delivery++;
+		deliver_frame(run, next, run.frame_state[next] == WRITTEN);
+	}
+	run.delivery_cv.notify_all();
+}
+
+// In `ordered` mode wait until frame `ix` is within the reorder window of the
+// oldest frame not yet delivered.
+static void wait_reorder_window(exrtool_run &run, size_t ix)
+{
+	if (!run.input.ordered) return;
+	std::unique_lock<std::mutex> lock(run.delivery_mutex);
+	wait_helping(run, lock, run.delivery_cv, [&]() {
+		return ix < run.next_delivery + run.reorder_window;
+	});
+}
+
+// Wait until the estimated memory use of frame `ix` fits in `memory_budget`
+// next to the frames already admitted, helping with chunk tasks meanwhile.
+// A frame is always admitted when no other one is, so frames larger than the
+// budget still run one at a time. Returns the estimate to release.
+static uint64_t admit_frame(exrtool_run &run, size_t ix)
+{
+	uint64_t budget = run.input.memory_budget;
+	if (budget == 0) return 0;
+	uint64_t estimate = estimate_frame_memory(run, ix);
+
+	std::unique_lock<std::mutex> lock(run.memory_mutex);
+	wait_helping(run, lock, run.memory_cv, [&]() {
+		return run.memory_admitted == 0 || run.memory_admitted + estimate <= budget;
+	});
+
+	run.memory_admitted += estimate;
+	run.memory_admitted_peak = std::max(run.memory_admitted_peak, run.memory_admitted);
+	return estimate;
+}
+
+static void release_frame(exrtool_run &run, uint64_t estimate)
+{
+	if (estimate == 0) return;
+	std::lock_guard<std::mutex> lg(run.memory_mutex);
+	run.memory_admitted -= estimate;
+	run.memory_cv.notify_all();
+}
+
+// Header and channels of an input file, owned until added to a merged frame.
+struct decoded_input
+{
+	bool decoded = false;
+	EXRHeader header;
+	EXRImage image;
+	std::vector<int> channel_mask;
+	memory_charge charge;
+	buffer_pool *pool = nullptr;
+
+	decoded_input() { }
+	decoded_input(const decoded_input&) = delete;
+	decoded_input& operator=(const decoded_input&) = delete;
+
+	~decoded_input()
+	{
+		if (!decoded) return;
+		FreeEXRHeader(&header);
+		pool->free_image(image);
+	}
+};
+
+// Parse the header of an input file and decode the channels used by the
+// output, reporting any errors.
+static bool decode_input(exrtool_run &run, const exrtool_run_file &file, const input_file &data, decoded_input &input)
+{
+	EXRHeader &header = input.header;
+	EXRImage &image = input.image;
+	std::vector<int> &channel_mask = input.channel_mask;
+
+	int ret;
+	const char *err = nullptr;
+	EXRVersion version;
+
+	ret = ParseEXRVersionFromMemory(&version, data.data, data.size);
+	if (ret) {
+		run.error("Failed to parse EXR version\n%s", file.name.c_str());
+		return false;
+	}
+
+	// Fields such as `long_name` are not set by the parser
+	InitEXRHeader(&header);
+	ret = ParseEXRHeaderFromMemory(&header, &version, data.data, data.size, &err);
+	if (ret) {
+		run.error("Failed to parse EXR header\n%s\n%s", file.name.c_str(), err);
+		FreeEXRErrorMessage(err);
+		return false;
+	}
+
+	// Only decode the channels that end up in the output
+	channel_mask.resize(header.num_channels);
+	for (int i = 0; i < header.num_channels; i++) {
+		channel_mask[i] = file.use_channel(header.channels[i].name) ? 1 : 0;
+	}
+
+	InitEXRImage(&image);
+	image.allocator = run.image_allocator;
+	ret = load_image(run, &image, &header, channel_mask.data(), data.data, data.size, &err);
+	if (ret) {
+		run.error("Failed to load EXR image\n%s\n%s", file.name.c_str(), err);
+		FreeEXRHeader(&header);
+		FreeEXRErrorMessage(err);
+		return false;
+	}
+
+	input.decoded = true;
+	input.pool = &run.buffers;
+	input.charge = memory_charge(run, decoded_size(header, channel_mask.data()));
+	return true;
+}
+
+// Decoded inputs of a frame and the merged output referencing their planes.
+struct merged_frame
+{
+	std::vector<EXRHeader> headers;
+	std::vector<EXRImage> images;
+	std::vector<memory_charge> charges;
+	buffer_pool *pool = nullptr;
+
+	std::vector<EXRChannelInfo> channels;
+	std::vector<unsigned char*> datas;
+	std::vector<int> channel_types;
+
+	EXRHeader header;
+	EXRImage image;
+
+	merged_frame() { }
+	merged_frame(const merged_frame&) = delete;
+	merged_frame& operator=(const merged_frame&) = delete;
+
+	~merged_frame() { release(); }
+
+	// Free the decoded inputs, invalidating `header` and `image`.
+	void release()
+	{
+		for (EXRHeader &header : headers) {
+			FreeEXRHeader(&header);
+		}
+		for (EXRImage &image : images) {
+			pool->free_image(image);
+		}
+		headers.clear();
+		images.clear();
+		charges.clear();
+		channels.clear();
+		datas.clear();
+	}
+
+	// Take ownership of a decoded input and add its selected channels,
+	// replacing channels of the same name from earlier inputs.
+	void add(decoded_input &input)
+	{
+		const EXRHeader &input_header = input.header;
+		const EXRImage &input_image = input.image;
+		const std::vector<int> &channel_mask = input.channel_mask;
+		for (size_t i = 0; i < input_header.num_channels; i++) {
+			EXRChannelInfo &chan = input_header.channels[i];
+			if (!channel_mask[i]) continue;
+			unsigned char *data = input_image.images[i];
+
+			auto it = std::lower_bound(channels.begin(), channels.end(), chan,
+				[](const EXRChannelInfo &lhs, const EXRChannelInfo &rhs) {
+				return strcmp(lhs.name, rhs.name) < 0;
+			});
+
+			size_t offset = it - channels.begin();
+			if (it != channels.end() && !strcmp(it->name, chan.name)) {
+				*it = chan;
+				datas[offset] = data;
+			} else {
+				channels.insert(it, chan);
+				datas.insert(datas.begin() + offset, data);
+			}
+		}
+
+		headers.push_back(input_header);
+		images.push_back(input_image);
+		charges.push_back(std::move(input.charge));
+		pool = input.pool;
+		input.decoded = false;
+	}
+
+	// Set up `header` and `image` for the output, based on the first input.
+	void finish()
+	{
+		header = headers[0];
+		image = images[0];
+
+		channel_types.clear();
+		channel_types.reserve(channels.size());
+		for (EXRChannelInfo &chan : channels) {
+			channel_types.push_back(chan.pixel_type);
+		}
+
+		header.channels = channels.data();
+		header.pixel_types = channel_types.data();
+		header.requested_pixel_types = channel_types.data();
+		header.num_channels = (int)channels.size();
+		image.images = datas.data();
+		image.num_channels = (int)datas.size();
+	}
+};
+
+bool process_frame(exrtool_run &run, size_t ix)
+{
+	uint32_t frame = run.frames[ix].first;
+	const std::vector<exrtool_run_file> &files = run.frames[ix].second;
+
+	struct admission {
+		exrtool_run &run;
+		uint64_t estimate;
+		~admission() { release_frame(run, estimate); }
+	} admitted { run, admit_frame(run, ix) };
+
+	// Inputs already read when falling back from merging blocks.
+	std::vector<std::unique_ptr<input_file>> acquired(files.size());
+
+	if (run.input.merge_mode == EXRTOOL_MERGE_BLOCKS) {
+		bool fallback = false;
+		bool ok = process_frame_blocks(run, ix, fallback, acquired);
+		if (!fallback) {
+			run.a_progress.fetch_add(1, std::memory_order_relaxed);
+			return ok;
+		}
+	}
+
+	// Inputs are read and decoded on up to `file_tasks` tasks and merged in
+	// order once all of them are done.
+	std::vector<decoded_input> inputs(files.size());
+	std::atomic_bool a_failed { false };
+	parallel_for(run.pool, files.size(), file_tasks(run, ix), [&](size_t file_ix) {
+		if (a_failed.load(std::memory_order_relaxed)) return;
+
+		std::unique_ptr<input_file> data = std::move(acquired[file_ix]);
+		if (!data) data = acquire_input(run, ix, file_ix);
+		if (!data || !decode_input(run, files[file_ix], *data, inputs[file_ix])) {
+			a_failed.store(true, std::memory_order_relaxed);
+			return;
+		}
+
+		run.a_progress.fetch_add(1, std::memory_order_relaxed);
+	});
+
+	merged_frame merged;
+	bool ok = !a_failed.load(std::memory_order_relaxed);
+	if (ok) {
+		for (decoded_input &input : inputs) {
+			merged.add(input);
+		}
+	}
+
+	if (ok && merged.channels.size() == 0) {
+		run.error("Frame %u has no channels", frame);
+		ok = false;
+	}
+
+	if (ok) {
+		merged.finish();
+		EXRHeader &header = merged.header;
+		EXRImage &image = merged.image;
+
+		std::string name = output_path(run, frame);
+
+		int ret;
+		const char *err = nullptr;
+		switch (run.input.write_mode) {
+		case EXRTOOL_WRITE_BUFFERED:
+			ret = save_exr_buffered(run, &image, &header, name.c_str(), &err);
+			break;
+		case EXRTOOL_WRITE_PARALLEL:
+			ret = save_exr_parallel(run, &image, &header, name.c_str(), &err);
+			break;
+		default:
+			ret = save_exr_stream(run, &header, image.width, image.height,
+				[&](int y, int, const unsigned char **lines, const char **) {
+				chunk_lines(&image, &header, y, lines);
+				return TINYEXR_SUCCESS;
+			}, encode_window(run), name.c_str(), &err);
+			break;
+		}
+
+		if (ret) {
+			run.error("Failed to save EXR image\n%s\n%s", name.c_str(), err);
+			FreeEXRErrorMessage(err);
+			ok = false;
+		}
+	}
+
+	run.a_progress.fetch_add(1, std::memory_order_relaxed);
+	return ok;
+}
+
+// Incrementally scan the attributes of a header. `pos` is the offset of the
+// next unscanned attribute and is updated as far as `size` bytes allow.
+// Returns true once the terminating null byte has been found, `pos` then
+// points one past it.
+static bool scan_header_end(const unsigned char *data, size_t size, size_t &pos, size_t &needed)
+{
+	// Until proven otherwise the next step needs at least one more byte.
+	needed = size + 1;
+
+	while (pos < size) {
+		if (data[pos] == 0) {
+			pos++;
+			return true;
+		}
+
+		const unsigned char *name_end = (const unsigned char*)memchr(data + pos, 0, size - pos);
+		if (!name_end) return false;
+		size_t type_pos = (size_t)(name_end - data) + 1;
+
+		const unsigned char *type_end = type_pos < size ? (const unsigned char*)memchr(data + type_pos, 0, size - type_pos) : nullptr;
+		if (!type_end) return false;
+		size_t size_pos = (size_t)(type_end - data) + 1;
+
+		if (size_pos + 4 > size) return false;
+		uint32_t value_size = (uint32_t)data[size_pos] | (uint32_t)data[size_pos + 1] << 8
+			| (uint32_t)data[size_pos + 2] << 16 | (uint32_t)data[size_pos + 3] << 24;
+
+		size_t next = size_pos + 4 + value_size;
+		if (next >= size) {
+			needed = next + 1;
+			return false;
+		}
+		pos = next;
+	}
+
+	return false;
+}
+
+bool process_next_frame(exrtool_run &run)
+{
+	uint32_t pos = run.a_frames_started.fetch_add(1, std::memory_order_relaxed);
 
-	return (uint32_t)atoi(begin);
+	// Moves the prefetch window forward
+	if (run.input.prefetch_depth > 0) {
+		std::lock_guard<std::mutex> lg(run.prefetch_mutex);
+		run.prefetch_cv.notify_all();
+	}
+
+	if (pos >= run.frames.size()) return false;
+	size_t ix = scheduled_frame(run, pos);
+	wait_reorder_window(run, ix);
+
+	if (!run.checkpoint()) {
+		run.a_progress.fetch_add((uint32_t)run.frames[ix].second.size() + 1, std::memory_order_relaxed);
+		complete_frame(run, ix, false);
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	bool ok = process_frame(run, ix);
+	uint64_t ns = elapsed_ns(start);
+	uint64_t longest = run.a_longest_frame_ns.load(std::memory_order_relaxed);
+	while (ns > longest && !run.a_longest_frame_ns.compare_exchange_weak(longest, ns, std::memory_order_relaxed)) { }
+
+	complete_frame(run, ix, ok);
+	return ok;
 }
 
-struct exrtool_run_file
+// Bounded blocking queue feeding a pipeline stage. Once every producer is
+// done `pop()` drains the remaining items and then returns false.
+template <typename T>
+struct stage_queue
 {
-	std::string name;
-	std::unordered_set<std::string> channels;
+	std::mutex mutex;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+	std::deque<T> items;
+	size_t capacity = 1;
+	size_t producers = 0;
 
-	bool use_channel(const char *channel) const
+	void push(T item)
 	{
-		return channels.count(channel) > 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [&]() { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+	}
+
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [&]() { return !items.empty() || producers == 0; });
+		if (items.empty()) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void producer_done()
+	{
+		std::lock_guard<std::mutex> lg(mutex);
+		if (--producers == 0) not_empty.notify_all();
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lg(mutex);
+		return items.size();
 	}
 };
 
-struct exrtool_run
+struct stage_state
 {
-	std::vector<std::pair<uint32_t, std::vector<exrtool_run_file>>> frames;
-	std::string output_name;
-	exrtool_input input;
+	size_t workers = 0;
+	std::atomic_uint32_t a_busy { 0 };
+	std::atomic_uint64_t a_items { 0 };
+	std::atomic_uint64_t a_busy_ns { 0 };
+	std::atomic_uint64_t a_idle_ns { 0 };
+	std::atomic_uint64_t a_blocked_ns { 0 };
+};
 
-	std::atomic_uint32_t a_frames_started;
-	std::atomic_uint32_t a_progress;
-	std::atomic_uint32_t a_threads_done;
+// Input file passing through the read and decode stages.
+struct pipeline_file
+{
+	size_t frame_ix = 0;
+	size_t file_ix = 0;
+	std::unique_ptr<input_file> data;
+	decoded_input input;
+};
 
-	std::vector<std::thread> threads;
+// Frame passing through the merge, encode and write stages.
+struct pipeline_frame
+{
+	size_t ix = 0;
+	merged_frame merged;
 
-	std::mutex error_mutex;
-	std::vector<std::string> errors;
+	// Allocated with `allocator`, the one of the merged image.
+	unsigned char *encoded = nullptr;
+	size_t encoded_size = 0;
+	const EXRAllocator *allocator = nullptr;
+	memory_charge charge;
 
-	void error(const char *fmt, ...)
+	~pipeline_frame()
 	{
-		char buf[1024];
-
-		va_list args;
-		va_start(args, fmt);
-		vsnprintf(buf, sizeof(buf), fmt, args);
-		va_end(args);
-
-		std::lock_guard<std::mutex> lg(error_mutex);
-		errors.push_back(buf);
+		exr_free(allocator, encoded);
 	}
-
 };
 
-bool process_frame(exrtool_run &run, uint32_t frame, const std::vector<exrtool_run_file> &files)
+typedef std::unique_ptr<pipeline_file> file_item;
+typedef std::unique_ptr<pipeline_frame> frame_item;
+
+// Frames processed as a pipeline of stages each with its own workers: read
+// input files, decode them, merge the decoded inputs of each frame, encode
+// the output in memory and write it. Stages are connected by bounded queues
+// so a slow stage stalls the ones before it instead of piling up data.
+struct frame_pipeline
 {
-	std::vector<EXRHeader> headers;
-	std::vector<EXRImage> images;
+	stage_state stages[EXRTOOL_STAGE_COUNT];
 
-	std::vector<EXRChannelInfo> channels;
-	std::vector<unsigned char*> datas;
+	stage_queue<file_item> decode_queue;
+	stage_queue<file_item> merge_queue;
+	stage_queue<frame_item> encode_queue;
+	stage_queue<frame_item> write_queue;
 
-	bool ok = true;
+	// Next input file claimed by the read workers, as a position in
+	// `run.order` and a file index.
+	std::mutex read_mutex;
+	size_t read_pos = 0;
+	size_t read_file = 0;
 
-	for (const exrtool_run_file &file : files) {
-		int ret;
-		const char *err = nullptr;
-		EXRVersion version;
+	// Estimated memory use of each frame, admitted by the worker reading its
+	// first input and released once it is written or has failed. The other
+	// inputs are only read once `frame_admitted`, signalled by `admit_cv`
+	// under `read_mutex`.
+	std::vector<uint64_t> admitted;
+	std::vector<bool> frame_admitted;
+	std::condition_variable admit_cv;
 
-		ret = ParseEXRVersionFromFile(&version, file.name.c_str());
-		if (ret) {
-			run.error("Failed to parse EXR version\n%s", file.name);
-			ok = false;
-			break;
-		}
+	// Decoded inputs of frames which are not complete yet.
+	std::mutex gather_mutex;
+	std::map<size_t, std::vector<file_item>> gather;
 
-		EXRHeader header;
-		ret = ParseEXRHeaderFromFile(&header, &version, file.name.c_str(), &err);
-		if (ret) {
-			run.error("Failed to parse EXR header\n%s\n%s", file.name, err);
-			FreeEXRErrorMessage(err);
-			ok = false;
-			break;
-		}
+	std::vector<std::thread> threads;
+};
 
-		EXRImage image;
-		InitEXRImage(&image);
+static void finish_pipeline_frame(exrtool_run &run, size_t ix, bool ok)
+{
+	release_frame(run, run.pipeline->admitted[ix]);
+	run.a_progress.fetch_add(1, std::memory_order_relaxed);
+	complete_frame(run, ix, ok);
+}
 
-		ret = LoadEXRImageFromFile(&image, &header, file.name.c_str(), &err);
-		if (ret) {
-			run.error("Failed to load EXR image\n%s\n%s", file.name, err);
-			FreeEXRHeader(&header);
-			FreeEXRErrorMessage(err);
-			ok = false;
-			break;
-		}
+// Worker loop of a stage: `process` turns an item from `in` into an item for
+// `out`, or consumes it by returning null.
+template <typename In, typename Out>
+static void run_stage(stage_state &stage, stage_queue<In> &in, stage_queue<Out> *out, const std::function<Out(In&)> &process)
+{
+	for (;;) {
+		In item;
+		auto start = std::chrono::steady_clock::now();
+		bool found = in.pop(item);
+		stage.a_idle_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+		if (!found) break;
 
-		run.a_progress.fetch_add(1, std::memory_order_relaxed);
+		stage.a_busy.fetch_add(1, std::memory_order_relaxed);
+		start = std::chrono::steady_clock::now();
+		Out result = process(item);
+		stage.a_busy_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+		stage.a_items.fetch_add(1, std::memory_order_relaxed);
+		stage.a_busy.fetch_sub(1, std::memory_order_relaxed);
+		thread_scratch::flush_current();
 
-		for (size_t i = 0; i < header.num_channels; i++) {
-			EXRChannelInfo &chan = header.channels[i];
-			if (!file.use_channel(chan.name)) continue;
-			unsigned char *data = image.images[i];
+		if (out && result) {
+			start = std::chrono::steady_clock::now();
+			out->push(std::move(result));
+			stage.a_blocked_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+		}
+	}
 
-			auto it = std::lower_bound(channels.begin(), channels.end(), chan,
-				[](const EXRChannelInfo &lhs, const EXRChannelInfo &rhs) {
-				return strcmp(lhs.name, rhs.name) < 0;
-			});
+	if (out) out->producer_done();
+}
 
-			size_t offset = it - channels.begin();
-			if (it != channels.end() && !strcmp(it->name, chan.name)) {
-				*it = chan;
-				datas[offset] = data;
-			} else {
-				channels.insert(it, chan);
-				datas.insert(datas.begin() + offset, data);
+static void read_stage(exrtool_run &run)
+{
+	frame_pipeline &pipe = *run.pipeline;
+	stage_state &stage = pipe.stages[EXRTOOL_STAGE_READ];
+
+	for (;;) {
+		size_t frame_ix = 0, file_ix = 0;
+		bool found = false;
+		{
+			std::lock_guard<std::mutex> lg(pipe.read_mutex);
+			while (!found && pipe.read_pos < run.frames.size()) {
+				frame_ix = scheduled_frame(run, pipe.read_pos);
+				if (pipe.read_file < run.frames[frame_ix].second.size()) {
+					file_ix = pipe.read_file++;
+					found = true;
+				} else {
+					pipe.read_pos++;
+					pipe.read_file = 0;
+				}
 			}
 		}
+		if (!found) break;
 
-		headers.push_back(header);
-		images.push_back(image);
-	}
+		stage.a_busy.fetch_add(1, std::memory_order_relaxed);
+		auto start = std::chrono::steady_clock::now();
+		file_item file(new pipeline_file());
+		file->frame_ix = frame_ix;
+		file->file_ix = file_ix;
+		if (file->file_ix == 0) {
+			wait_reorder_window(run, file->frame_ix);
+			pipe.admitted[file->frame_ix] = admit_frame(run, file->frame_ix);
+			std::lock_guard<std::mutex> lg(pipe.read_mutex);
+			pipe.frame_admitted[file->frame_ix] = true;
+			pipe.admit_cv.notify_all();
+		} else {
+			std::unique_lock<std::mutex> lock(pipe.read_mutex);
+			pipe.admit_cv.wait(lock, [&]() { return pipe.frame_admitted[file->frame_ix]; });
+		}
+		if (run.checkpoint()) file->data = acquire_input(run, file->frame_ix, file->file_ix);
+		stage.a_busy_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+		stage.a_items.fetch_add(1, std::memory_order_relaxed);
+		stage.a_busy.fetch_sub(1, std::memory_order_relaxed);
 
-	if (ok && channels.size() == 0) {
-		run.error("Frame %u has no channels", frame);
-		ok = false;
+		start = std::chrono::steady_clock::now();
+		pipe.decode_queue.push(std::move(file));
+		stage.a_blocked_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
 	}
 
-	if (ok) {
-		EXRHeader header = headers[0];
-		EXRImage image = images[0];
-
-		std::vector<int> channel_types;
-		channel_types.reserve(channels.size());
-		for (EXRChannelInfo &chan : channels) {
-			channel_types.push_back(chan.pixel_type);
-		}
+	pipe.decode_queue.producer_done();
+}
 
-		header.channels = channels.data();
-		header.pixel_types = channel_types.data();
-		header.requested_pixel_types = channel_types.data();
-		header.num_channels = (int)channels.size();
-		image.images = datas.data();
-		image.num_channels = (int)datas.size();
+static file_item decode_stage(exrtool_run &run, file_item &file)
+{
+	if (file->data && run.checkpoint()) {
+		const exrtool_run_file &info = run.frames[file->frame_ix].second[file->file_ix];
+		bool ok = decode_input(run, info, *file->data, file->input);
+		file->data.reset();
+		if (ok) run.a_progress.fetch_add(1, std::memory_order_relaxed);
+	}
+	return std::move(file);
+}
 
-		std::string name = run.output_name;
-		size_t end = name.find_last_of('#');
-		if (frame != ~0u && end != std::string::npos) {
-			size_t begin = end;
-			while (begin > 0 && name[begin - 1] == '#') begin--;
+static frame_item merge_stage(exrtool_run &run, file_item &file)
+{
+	frame_pipeline &pipe = *run.pipeline;
+	size_t ix = file->frame_ix;
+	const std::vector<exrtool_run_file> &files = run.frames[ix].second;
 
-			size_t num = end - begin + 1;
-			char buf[32];
-			snprintf(buf, sizeof(buf), "%0*u", (int)num, frame);
-			name.replace(begin, num, buf);
-		}
+	std::vector<file_item> inputs;
+	{
+		std::lock_guard<std::mutex> lg(pipe.gather_mutex);
+		std::vector<file_item> &list = pipe.gather[ix];
+		list.push_back(std::move(file));
+		if (list.size() < files.size()) return nullptr;
+		inputs = std::move(list);
+		pipe.gather.erase(ix);
+	}
 
-		int ret;
-		const char *err = nullptr;
-		ret = SaveEXRImageToFile(&image, &header, name.c_str(), &err);
+	std::sort(inputs.begin(), inputs.end(), [](const file_item &lhs, const file_item &rhs) {
+		return lhs->file_ix < rhs->file_ix;
+	});
 
-		if (ret) {
-			run.error("Failed to save EXR image\n%s\n%s", name, err);
-			FreeEXRErrorMessage(err);
+	frame_item frame(new pipeline_frame());
+	frame->ix = ix;
+	bool ok = true;
+	for (file_item &input : inputs) {
+		if (!input->input.decoded) {
 			ok = false;
+			continue;
 		}
+		frame->merged.add(input->input);
 	}
 
-	run.a_progress.fetch_add(1, std::memory_order_relaxed);
+	if (ok && frame->merged.channels.size() == 0) {
+		run.error("Frame %u has no channels", run.frames[ix].first);
+		ok = false;
+	}
+	if (!ok) {
+		finish_pipeline_frame(run, ix, false);
+		return nullptr;
+	}
 
-	for (EXRHeader &header : headers) {
-		FreeEXRHeader(&header);
+	frame->merged.finish();
+	return frame;
+}
+
+static frame_item encode_stage(exrtool_run &run, frame_item &frame)
+{
+	if (!run.checkpoint()) {
+		finish_pipeline_frame(run, frame->ix, false);
+		return nullptr;
 	}
-	for (EXRImage &image : images) {
-		FreeEXRImage(&image);
+
+	const char *err = nullptr;
+	frame->allocator = frame->merged.image.allocator;
+	frame->encoded_size = SaveEXRImageToMemory(&frame->merged.image, &frame->merged.header, &frame->encoded, &err);
+	frame->merged.release();
+	frame->charge = memory_charge(run, frame->encoded_size);
+
+	if (frame->encoded_size == 0) {
+		std::string name = output_path(run, run.frames[frame->ix].first);
+		run.error("Failed to save EXR image\n%s\n%s", name.c_str(), err);
+		FreeEXRErrorMessage(err);
+		finish_pipeline_frame(run, frame->ix, false);
+		return nullptr;
 	}
 
-	return ok;
+	return std::move(frame);
 }
 
-bool process_next_frame(exrtool_run &run)
+static frame_item write_stage(exrtool_run &run, frame_item &frame)
+{
+	size_t ix = frame->ix;
+	std::string name = output_path(run, run.frames[frame->ix].first);
+	const char *err = nullptr;
+	bool ok = run.checkpoint();
+	if (ok && write_output(run, name.c_str(), frame->encoded, frame->encoded_size, &err)) {
+		run.error("Failed to save EXR image\n%s\n%s", name.c_str(), err);
+		FreeEXRErrorMessage(err);
+		ok = false;
+	}
+
+	frame.reset();
+	finish_pipeline_frame(run, ix, ok);
+	return nullptr;
+}
+
+template <typename T>
+static void setup_queue(stage_queue<T> &queue, size_t capacity, const stage_state &producer, const stage_state &consumer)
 {
-	uint32_t ix = run.a_frames_started.fetch_add(1, std::memory_order_relaxed);
-	if (ix >= run.frames.size()) return false;
+	queue.capacity = capacity ? capacity : consumer.workers * 2;
+	queue.producers = producer.workers;
+}
+
+static void start_pipeline(exrtool_run *run)
+{
+	run->pipeline.reset(new frame_pipeline());
+	frame_pipeline &pipe = *run->pipeline;
+
+	pipe.admitted.resize(run->frames.size());
+	pipe.frame_admitted.resize(run->frames.size());
 
-	auto &pair = run.frames[ix];
-	return process_frame(run, pair.first, pair.second);
+	size_t cores = run->limits.usable_cpus();
+	size_t defaults[EXRTOOL_STAGE_COUNT] = { 2, std::max(cores / 2, (size_t)1), 1, std::max(cores / 2, (size_t)1), 1 };
+	size_t total_workers = 0;
+	for (size_t i = 0; i < EXRTOOL_STAGE_COUNT; i++) {
+		size_t workers = run->input.stage_threads[i];
+		pipe.stages[i].workers = workers ? workers : defaults[i];
+		total_workers += pipe.stages[i].workers;
+	}
+	run->reorder_window = run->input.reorder_window ? run->input.reorder_window : total_workers * 2;
+
+	size_t capacity = run->input.stage_queue_capacity;
+	setup_queue(pipe.decode_queue, capacity, pipe.stages[EXRTOOL_STAGE_READ], pipe.stages[EXRTOOL_STAGE_DECODE]);
+	setup_queue(pipe.merge_queue, capacity, pipe.stages[EXRTOOL_STAGE_DECODE], pipe.stages[EXRTOOL_STAGE_MERGE]);
+	setup_queue(pipe.encode_queue, capacity, pipe.stages[EXRTOOL_STAGE_MERGE], pipe.stages[EXRTOOL_STAGE_ENCODE]);
+	setup_queue(pipe.write_queue, capacity, pipe.stages[EXRTOOL_STAGE_ENCODE], pipe.stages[EXRTOOL_STAGE_WRITE]);
+
+	auto spawn = [&](std::function<void()> fn) {
+		pipe.threads.emplace_back([=]() {
+			thread_scratch codec_scratch(run->pool.scratch);
+			govern_thread(run->input);
+			fn();
+		});
+	};
+	for (size_t i = 0; i < pipe.stages[EXRTOOL_STAGE_READ].workers; i++) {
+		spawn([=]() { read_stage(*run); });
+	}
+	for (size_t i = 0; i < pipe.stages[EXRTOOL_STAGE_DECODE].workers; i++) {
+		spawn([=]() {
+			run_stage<file_item, file_item>(run->pipeline->stages[EXRTOOL_STAGE_DECODE], run->pipeline->decode_queue, &run->pipeline->merge_queue,
+				[=](file_item &file) { return decode_stage(*run, file); });
+		});
+	}
+	for (size_t i = 0; i < pipe.stages[EXRTOOL_STAGE_MERGE].workers; i++) {
+		spawn([=]() {
+			run_stage<file_item, frame_item>(run->pipeline->stages[EXRTOOL_STAGE_MERGE], run->pipeline->merge_queue, &run->pipeline->encode_queue,
+				[=](file_item &file) { return merge_stage(*run, file); });
+		});
+	}
+	for (size_t i = 0; i < pipe.stages[EXRTOOL_STAGE_ENCODE].workers; i++) {
+		spawn([=]() {
+			run_stage<frame_item, frame_item>(run->pipeline->stages[EXRTOOL_STAGE_ENCODE], run->pipeline->encode_queue, &run->pipeline->write_queue,
+				[=](frame_item &frame) { return encode_stage(*run, frame); });
+		});
+	}
+	for (size_t i = 0; i < pipe.stages[EXRTOOL_STAGE_WRITE].workers; i++) {
+		spawn([=]() {
+			run_stage<frame_item, frame_item>(run->pipeline->stages[EXRTOOL_STAGE_WRITE], run->pipeline->write_queue, nullptr,
+				[=](frame_item &frame) { return write_stage(*run, frame); });
+		});
+	}
 }
 
 #ifdef __cplusplus
@@ -229,28 +3650,78 @@ exrtool_run *exrtool_process(const exrtool_input *input)
 	run->frames = decltype(run->frames)(frames.begin(), frames.end());
 	run->output_name = input->output_file;
 	run->input = *input;
+	run->start_time = std::chrono::steady_clock::now();
+	run->frame_state.resize(run->frames.size());
+
+	// Inside a memory limited container leave a quarter of the limit for
+	// everything but the frames in flight.
+	run->limits = detect_limits();
+	if (run->input.memory_budget == 0 && run->limits.memory_limit > 0) {
+		run->input.memory_budget = run->limits.memory_limit / 4 * 3;
+	}
+
+	run->cpus.assign(input->cpus, input->cpus + input->num_cpus);
+	run->input.cpus = run->cpus.data();
+	run->limits.restrict_to(run->cpus);
+	run->start_faults = page_faults();
+	run->buffers.enabled = input->buffer_pool;
+	run->buffers.huge_pages = input->huge_pages;
+	run->buffers.workers = &run->pool;
+	if (has_allocator(run->input.allocator)) {
+		run->buffers.allocator = &run->input.allocator;
+		run->exr_allocator.allocate = exr_allocate;
+		run->exr_allocator.deallocate = exr_deallocate;
+		run->exr_allocator.user = &run->input.allocator;
+		run->image_allocator = &run->exr_allocator;
+	}
+	run->read_limit.set_rate(input->read_limit_mbps * 1e6);
+	run->write_limit.set_rate(input->write_limit_mbps * 1e6);
+
+	if (input->pipeline) {
+		// The read stage reads ahead instead.
+		run->input.prefetch_depth = 0;
+		schedule_frames(*run);
+		start_pipeline(run);
+		return run;
+	}
 
 	size_t num_threads = input->num_threads;
-	if (num_threads == 0) {
-		size_t cores = std::thread::hardware_concurrency();
-		if (cores > 2) {
-			num_threads = cores - 2;
-		} else {
-			num_threads = 1;
+	if (num_threads == 0) num_threads = default_num_threads(*run);
+
+	run->reorder_window = input->reorder_window ? input->reorder_window : num_threads * 2;
+	run->pool.help_first = input->ordered;
+	if (input->numa) run->pool.nodes = run->limits.nodes;
+	run->pool.thread_init = [=]() { govern_thread(run->input); };
+	run->pool.start(num_threads);
+	schedule_frames(*run);
+
+	if (input->auto_threads) {
+		run->tuning = true;
+		run->tune_start = std::chrono::steady_clock::now();
+	}
+
+	if (input->prefetch_depth > 0) {
+		size_t max_files = 0;
+		run->prefetch.resize(run->frames.size());
+		for (size_t i = 0; i < run->frames.size(); i++) {
+			run->prefetch[i] = std::vector<prefetch_slot>(run->frames[i].second.size());
+			max_files = std::max(max_files, run->frames[i].second.size());
+		}
+
+		// Enough concurrent reads to fill the window quickly on high latency
+		// storage, without a thread per file for deep windows.
+		size_t num_io_threads = std::min(input->prefetch_depth * max_files, (size_t)16);
+		for (size_t i = 0; i < num_io_threads; i++) {
+			run->io_threads.emplace_back([=](){
+				govern_thread(run->input);
+				prefetch_inputs(*run);
+			});
 		}
 	}
 
-	for (size_t i = 0; i < num_threads; i++) {
-		run->threads.emplace_back([=](){
-			while (process_next_frame(*run)) {
-				if (run->input.progress_fn) {
-					run->input.progress_fn(run, run->input.progress_user);
-				}
-			}
-			run->a_threads_done.fetch_add(1, std::memory_order_release);
-			if (run->input.progress_fn) {
-				run->input.progress_fn(run, run->input.progress_user);
-			}
+	for (size_t i = 0; i < run->frames.size(); i++) {
+		run->pool.submit_frame([=](){
+			process_next_frame(*run);
 		});
 	}
 
@@ -263,7 +3734,250 @@ bool exrtool_poll(exrtool_run *run, exrtool_progress *progress)
 		progress->done = run->a_progress.load(std::memory_order_relaxed);
 		progress->max = run->input.num_files + run->frames.size();
 	}
-	return run->a_threads_done.load(std::memory_order_acquire) == run->threads.size();
+	return run->a_frames_done.load(std::memory_order_acquire) == run->frames.size();
+}
+
+int exrtool_probe_header(const char *name, EXRHeader *header, exrtool_header_info *info, const char **err)
+{
+	FILE *f = open_file(name, "rb");
+	if (!f) {
+		set_error(err, "Failed to open file");
+		return TINYEXR_ERROR_CANT_OPEN_FILE;
+	}
+
+	// Most headers fit in the first read, grow geometrically otherwise so
+	// that huge attributes still only cost a few reads.
+	std::vector<unsigned char> buf;
+	size_t num_read = 0;
+	size_t pos = 8, needed = 8;
+	EXRVersion version;
+	bool has_version = false;
+	bool part_end = false;
+	bool done = false;
+	int ret = TINYEXR_SUCCESS;
+
+	while (!done) {
+		if (needed > num_read) {
+			size_t size = std::max(needed, buf.size() * 2);
+			size = std::max(size, (size_t)4096);
+			buf.resize(size);
+			size_t num = fread(buf.data() + num_read, 1, size - num_read, f);
+			num_read += num;
+			if (num_read < needed) {
+				set_error(err, "Unexpected end of file in EXR header");
+				ret = TINYEXR_ERROR_INVALID_HEADER;
+				break;
+			}
+		}
+
+		if (!has_version) {
+			ret = ParseEXRVersionFromMemory(&version, buf.data(), num_read);
+			if (ret) {
+				set_error(err, "Failed to parse EXR version");
+				break;
+			}
+			has_version = true;
+		}
+
+		// Multi-part files have a list of headers terminated by an empty one,
+		// the byte after a part header has been read by now.
+		if (part_end) {
+			part_end = false;
+			if (buf[pos] == 0) {
+				pos++;
+				done = true;
+				continue;
+			}
+		}
+
+		if (scan_header_end(buf.data(), num_read, pos, needed)) {
+			// Stop after the first part of single-part files.
+			if (!version.multipart) {
+				done = true;
+			} else {
+				part_end = true;
+				needed = pos + 1;
+			}
+		}
+	}
+
+	fclose(f);
+	if (!done) return ret;
+
+	InitEXRHeader(header);
+	ret = ParseEXRHeaderFromMemory(header, &version, buf.data(), pos, err);
+	if (ret) return ret;
+
+	if (info) {
+		info->header_size = pos - 8;
+		info->offset_table_pos = pos;
+		info->bytes_read = num_read;
+	}
+
+	return TINYEXR_SUCCESS;
+}
+
+void exrtool_get_stats(exrtool_run *run, exrtool_stats *stats)
+{
+	stats->input_bytes = run->a_input_bytes.load(std::memory_order_relaxed);
+	stats->bytes_read = run->a_bytes_read.load(std::memory_order_relaxed);
+	stats->files_mapped = run->a_files_mapped.load(std::memory_order_relaxed);
+	stats->bytes_written = run->a_bytes_written.load(std::memory_order_relaxed);
+	stats->files_prefetched = run->a_files_prefetched.load(std::memory_order_relaxed);
+	stats->io_stall_seconds = (double)run->a_io_stall_ns.load(std::memory_order_relaxed) * 1e-9;
+	stats->read_seconds = (double)run->a_read_ns.load(std::memory_order_relaxed) * 1e-9;
+	stats->write_seconds = (double)run->a_write_ns.load(std::memory_order_relaxed) * 1e-9;
+	{
+		std::lock_guard<std::mutex> lg(run->pause_mutex);
+		stats->paused = run->pool.a_paused.load(std::memory_order_relaxed);
+		uint64_t paused_ns = run->paused_ns;
+		if (stats->paused) paused_ns += elapsed_ns(run->pause_start);
+		stats->paused_seconds = (double)paused_ns * 1e-9;
+		stats->bytes_released = run->bytes_released;
+	}
+	stats->parked_threads = run->pool.a_parked.load(std::memory_order_relaxed);
+
+	uint64_t makespan_ns = run->a_makespan_ns.load(std::memory_order_relaxed);
+	stats->num_threads = run->pool.size();
+	uint64_t run_ns = makespan_ns ? makespan_ns : elapsed_ns(run->start_time);
+	stats->frames_per_second = (double)run->a_frames_done.load(std::memory_order_relaxed) / std::max((double)run_ns * 1e-9, 1e-9);
+
+	stats->detected_cpus = run->limits.cpus;
+	stats->affinity_cpus = run->limits.affinity_cpus;
+	stats->cpu_quota = run->limits.cpu_quota;
+	stats->memory_limit = run->limits.memory_limit;
+	stats->physical_memory = run->limits.physical_memory;
+	stats->memory_budget = run->input.memory_budget;
+	uint64_t faults = page_faults();
+	stats->page_faults = faults - std::min(faults, run->start_faults);
+	stats->buffers_allocated = run->buffers.a_allocations.load(std::memory_order_relaxed);
+	stats->buffers_reused = run->buffers.a_reuses.load(std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lg(run->buffers.mutex);
+		stats->pool_bytes = run->buffers.free_bytes;
+	}
+	stats->scratch_bytes = run->pool.scratch.a_bytes.load(std::memory_order_relaxed);
+	stats->scratch_allocations = run->pool.scratch.a_allocations.load(std::memory_order_relaxed);
+	stats->scratch_reuses = run->pool.scratch.a_reuses.load(std::memory_order_relaxed);
+	stats->numa_nodes = run->limits.nodes.size();
+	stats->read_mbps = (double)stats->bytes_read / std::max((double)run_ns * 1e-9, 1e-9) * 1e-6;
+	stats->write_mbps = (double)stats->bytes_written / std::max((double)run_ns * 1e-9, 1e-9) * 1e-6;
+	stats->throttle_seconds = (double)(run->read_limit.a_wait_ns.load(std::memory_order_relaxed) + run->write_limit.a_wait_ns.load(std::memory_order_relaxed)) * 1e-9;
+	stats->remote_tasks = run->pool.a_remote_tasks.load(std::memory_order_relaxed);
+
+	stats->cancelled = run->cancelled();
+	stats->cancel_latency_seconds = 0.0;
+	if (stats->cancelled && makespan_ns > 0) {
+		uint64_t cancel_ns = run->a_cancel_ns.load(std::memory_order_relaxed);
+		stats->cancel_latency_seconds = (double)(makespan_ns - std::min(makespan_ns, cancel_ns)) * 1e-9;
+	}
+	stats->first_frame_seconds = (double)run->a_first_frame_ns.load(std::memory_order_relaxed) * 1e-9;
+	stats->makespan_seconds = (double)run->a_makespan_ns.load(std::memory_order_relaxed) * 1e-9;
+	stats->ideal_makespan_seconds = 0.0;
+	// The busy time divided by the average worker count, which changes when
+	// the pool is resized during the run.
+	uint64_t worker_ns = makespan_ns ? run->a_makespan_worker_ns.load(std::memory_order_relaxed) : run->pool.worker_time_ns();
+	if (worker_ns > 0) {
+		double workers = (double)worker_ns / (double)std::max(run_ns, (uint64_t)1);
+		double busy = (double)run->pool.a_busy_ns.load(std::memory_order_relaxed) * 1e-9 / workers;
+		double longest = (double)run->a_longest_frame_ns.load(std::memory_order_relaxed) * 1e-9;
+		stats->ideal_makespan_seconds = std::max(busy, longest);
+	}
+	stats->memory_peak = run->a_memory_peak.load(std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lg(run->memory_mutex);
+		stats->memory_estimate_peak = run->memory_admitted_peak;
+	}
+
+	for (size_t i = 0; i < EXRTOOL_STAGE_COUNT; i++) {
+		stats->stages[i] = exrtool_stage_stats { };
+	}
+	if (run->pipeline) {
+		frame_pipeline &pipe = *run->pipeline;
+		size_t queued[EXRTOOL_STAGE_COUNT] = { 0, pipe.decode_queue.size(), pipe.merge_queue.size(), pipe.encode_queue.size(), pipe.write_queue.size() };
+		size_t capacity[EXRTOOL_STAGE_COUNT] = { 0, pipe.decode_queue.capacity, pipe.merge_queue.capacity, pipe.encode_queue.capacity, pipe.write_queue.capacity };
+		for (size_t i = 0; i < EXRTOOL_STAGE_COUNT; i++) {
+			stage_state &state = pipe.stages[i];
+			exrtool_stage_stats &stage = stats->stages[i];
+			stage.workers = state.workers;
+			stage.busy = state.a_busy.load(std::memory_order_relaxed);
+			stage.queued = queued[i];
+			stage.capacity = capacity[i];
+			stage.items = state.a_items.load(std::memory_order_relaxed);
+			stage.busy_seconds = (double)state.a_busy_ns.load(std::memory_order_relaxed) * 1e-9;
+			stage.idle_seconds = (double)state.a_idle_ns.load(std::memory_order_relaxed) * 1e-9;
+			stage.blocked_seconds = (double)state.a_blocked_ns.load(std::memory_order_relaxed) * 1e-9;
+			stats->ideal_makespan_seconds = std::max(stats->ideal_makespan_seconds, stage.busy_seconds / (double)stage.workers);
+		}
+	}
+}
+
+void exrtool_cancel(exrtool_run *run)
+{
+	if (run->a_cancelled.exchange(true)) return;
+	run->a_cancel_ns.store(elapsed_ns(run->start_time), std::memory_order_relaxed);
+
+	// Wake up parked threads and the prefetch threads so that they exit
+	exrtool_resume(run);
+}
+
+void exrtool_set_num_threads(exrtool_run *run, size_t num_threads)
+{
+	if (run->pipeline) return;
+	std::lock_guard<std::mutex> lg(run->tune_mutex);
+	run->tuning = false;
+	run->pool.resize(num_threads ? num_threads : default_num_threads(*run));
+}
+
+void exrtool_pause(exrtool_run *run)
+{
+	{
+		std::lock_guard<std::mutex> lg(run->pause_mutex);
+		if (run->pool.a_paused.load(std::memory_order_relaxed) || run->cancelled()) return;
+		run->pause_start = std::chrono::steady_clock::now();
+		run->pool.set_paused(true);
+	}
+
+	// Drop inputs read ahead for frames that have not started, they are read
+	// again after resuming.
+	uint64_t released = 0;
+	if (run->input.prefetch_depth > 0) {
+		std::lock_guard<std::mutex> lg(run->prefetch_mutex);
+		size_t started = std::min((size_t)run->a_frames_started.load(std::memory_order_relaxed), run->frames.size());
+		size_t scheduled = run->a_scheduled.load(std::memory_order_acquire);
+		for (size_t pos = started; pos < scheduled; pos++) {
+			for (prefetch_slot &slot : run->prefetch[run->order[pos]]) {
+				if (slot.state != prefetch_slot::DONE) continue;
+				if (slot.file) released += slot.file->size;
+				slot.file.reset();
+				slot.state = prefetch_slot::PENDING;
+			}
+		}
+		if (run->prefetch_frame > started) {
+			run->prefetch_frame = started;
+			run->prefetch_file = 0;
+		}
+	}
+
+	released += run->buffers.trim();
+	release_heap();
+
+	std::lock_guard<std::mutex> lg(run->pause_mutex);
+	run->bytes_released += released;
+}
+
+void exrtool_resume(exrtool_run *run)
+{
+	{
+		std::lock_guard<std::mutex> lg(run->pause_mutex);
+		if (run->pool.a_paused.load(std::memory_order_relaxed)) {
+			run->paused_ns += elapsed_ns(run->pause_start);
+			run->pool.set_paused(false);
+		}
+	}
+
+	std::lock_guard<std::mutex> lg(run->prefetch_mutex);
+	run->prefetch_cv.notify_all();
 }
 
 size_t exrtool_get_num_errors(exrtool_run *run)
@@ -281,9 +3995,17 @@ const char *exrtool_get_error(exrtool_run *run, size_t index)
 
 void exrtool_free(exrtool_run *run)
 {
-	for (auto &thread : run->threads) {
+	// Parked workers, prefetch and pipeline threads would never return.
+	exrtool_resume(run);
+	run->pool.stop();
+	for (auto &thread : run->io_threads) {
 		thread.join();
 	}
+	if (run->pipeline) {
+		for (auto &thread : run->pipeline->threads) {
+			thread.join();
+		}
+	}
 	delete run;
 }
 
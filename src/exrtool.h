@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 #ifdef __cplusplus
@@ -9,6 +10,7 @@ extern "C" {
 
 typedef struct exrtool_run exrtool_run;
 typedef void (*exrtool_progress_fn)(exrtool_run *run, void *user);
+typedef void (*exrtool_frame_fn)(exrtool_run *run, uint32_t frame, const char *path, bool ok, void *user);
 
 typedef struct exrtool_file {
 	const char *name;
@@ -16,6 +18,103 @@ typedef struct exrtool_file {
 	size_t num_channels;
 } exrtool_file;
 
+typedef enum exrtool_read_mode {
+	// Memory map input files unless they are on a network filesystem.
+	EXRTOOL_READ_AUTO,
+	// Read input files into a heap buffer.
+	EXRTOOL_READ_BUFFERED,
+	// Memory map input files, falling back to buffered reads on failure.
+	EXRTOOL_READ_MMAP,
+} exrtool_read_mode;
+
+typedef enum exrtool_write_mode {
+	// Encode and write the output one chunk at a time, the offset table is
+	// patched in at the end.
+	EXRTOOL_WRITE_STREAM,
+	// Encode the whole output file in memory before writing it.
+	EXRTOOL_WRITE_BUFFERED,
+	// Encode chunks on `num_write_threads` tasks, each writing its chunks
+	// directly at their own offset in a preallocated file. Chunks are stored
+	// in completion order, the offset table is written last.
+	EXRTOOL_WRITE_PARALLEL,
+} exrtool_write_mode;
+
+typedef enum exrtool_merge_mode {
+	// Decode every input image fully before merging and saving the frame.
+	EXRTOOL_MERGE_IMAGE,
+	// Decode, merge, encode and write the frame one output chunk at a time so
+	// that only a chunk per input is held in decoded form. Always writes in
+	// `EXRTOOL_WRITE_STREAM` mode. Frames with tiled, multipart, decreasing Y
+	// or differently sized inputs are merged as whole images.
+	EXRTOOL_MERGE_BLOCKS,
+} exrtool_merge_mode;
+
+typedef enum exrtool_cache_policy {
+	// Regular I/O through the page cache.
+	EXRTOOL_CACHE_BUFFERED,
+	// Regular I/O, dropping the file from the page cache once it has been
+	// read or written. Inputs are not memory mapped.
+	EXRTOOL_CACHE_DONTNEED,
+	// Unbuffered I/O bypassing the page cache with aligned buffers. Falls back
+	// to `EXRTOOL_CACHE_DONTNEED` where not supported and for parallel
+	// writes. Inputs are not memory mapped.
+	EXRTOOL_CACHE_DIRECT,
+} exrtool_cache_policy;
+
+typedef enum exrtool_schedule {
+	// Start frames in frame number order.
+	EXRTOOL_SCHEDULE_IN_ORDER,
+	// Start the most expensive frames first so that no large frame is left
+	// running alone at the end. Costs are estimated from the input file sizes
+	// and headers, which are probed in the background: until every frame is
+	// probed the most expensive of the ones probed so far is started.
+	EXRTOOL_SCHEDULE_LONGEST_FIRST,
+} exrtool_schedule;
+
+typedef enum exrtool_io_priority {
+	// Leave the I/O priority of the threads unchanged.
+	EXRTOOL_IO_PRIORITY_NORMAL,
+	// Lowest best effort priority. Linux only.
+	EXRTOOL_IO_PRIORITY_LOW,
+	// Only do I/O when the disk is otherwise idle, background mode on
+	// Windows.
+	EXRTOOL_IO_PRIORITY_IDLE,
+} exrtool_io_priority;
+
+typedef enum exrtool_buffer_kind {
+	// Contents of an input file.
+	EXRTOOL_BUFFER_INPUT,
+	// Decoded channel planes.
+	EXRTOOL_BUFFER_IMAGE,
+	// Encoded chunks and outputs encoded in memory.
+	EXRTOOL_BUFFER_CHUNK,
+} exrtool_buffer_kind;
+
+// Host allocator for the input, pixel plane and chunk buffers of a run,
+// including the planes and encoded outputs tinyexr allocates. Either pair of
+// functions may be left null: plain allocations then use the aligned pair
+// with an alignment of 16 and aligned ones are carved out of plain
+// allocations. Called from any thread of the run.
+typedef struct exrtool_allocator {
+	void *(*malloc_fn)(size_t size, void *user);
+	void (*free_fn)(void *ptr, void *user);
+	// `alignment` is a power of two, `kind` what the buffer is first used
+	// for. With `buffer_pool` sizes are rounded up to the size classes of the
+	// pool and buffers are reused for any kind.
+	void *(*aligned_malloc_fn)(size_t size, size_t alignment, exrtool_buffer_kind kind, void *user);
+	void (*aligned_free_fn)(void *ptr, void *user);
+	void *user;
+} exrtool_allocator;
+
+typedef enum exrtool_stage {
+	EXRTOOL_STAGE_READ,
+	EXRTOOL_STAGE_DECODE,
+	EXRTOOL_STAGE_MERGE,
+	EXRTOOL_STAGE_ENCODE,
+	EXRTOOL_STAGE_WRITE,
+	EXRTOOL_STAGE_COUNT,
+} exrtool_stage;
+
 typedef struct exrtool_input {
 
 	const char *output_file;
@@ -23,11 +122,94 @@ typedef struct exrtool_input {
 	const exrtool_file *files;
 	size_t num_files;
 
+	// Worker threads shared by all frames, 0 picks a default from the number
+	// of cores the process may use, considering its affinity mask and cgroup
+	// CPU quota.
 	size_t num_threads;
+	// Adjust the number of worker threads during the run to maximize the
+	// measured frame rate, starting from `num_threads`.
+	bool auto_threads;
+	// Concurrent encode tasks per output file for `EXRTOOL_WRITE_PARALLEL`,
+	// 0 for one per worker thread.
+	size_t num_write_threads;
+	// Bind the worker threads round robin to the NUMA nodes and keep every
+	// frame on the node of the worker that starts it, so that its decoded
+	// planes and encode buffers are allocated and used on the same node.
+	// No effect on single node systems and in pipeline mode.
+	bool numa;
+
+	// Restrict every thread of the run to these CPUs, none for no
+	// restriction. Worker defaults are derived from their number.
+	const int *cpus;
+	size_t num_cpus;
+	// Niceness of the threads of the run, 0 leaves it unchanged. Negative
+	// values need privileges.
+	int nice;
+	exrtool_io_priority io_priority;
+	// Caps on the input and output bandwidth in MB/s shared by all threads of
+	// the run, 0 for none. I/O is split into 1 MiB slices that wait for their
+	// share. Inputs are not memory mapped while reads are capped.
+	double read_limit_mbps;
+	double write_limit_mbps;
+
+	exrtool_read_mode read_mode;
+	exrtool_write_mode write_mode;
+	exrtool_merge_mode merge_mode;
+	exrtool_schedule schedule;
+
+	// Page cache use for reading input files and writing output files.
+	exrtool_cache_policy input_cache;
+	exrtool_cache_policy output_cache;
+
+	// Number of frames past the ones being processed to read input files for
+	// in the background, 0 reads inputs on the processing threads.
+	size_t prefetch_depth;
+
+	// Process frames as a pipeline of stages with dedicated threads connected
+	// by bounded queues instead of on the shared worker pool. Outputs are
+	// always encoded in memory, `num_threads`, `num_write_threads`,
+	// `write_mode`, `merge_mode` and `prefetch_depth` are ignored.
+	bool pipeline;
+	// Threads per pipeline stage, 0 picks a default.
+	size_t stage_threads[EXRTOOL_STAGE_COUNT];
+	// Items queued in front of each pipeline stage before the previous one
+	// blocks, 0 for twice the number of threads of the stage.
+	size_t stage_queue_capacity;
+
+	// Bytes of memory that the frames being processed may use at once as
+	// estimated from their headers, frames wait to start until they fit.
+	// Inputs read ahead by `prefetch_depth` are not included. 0 for three
+	// quarters of the cgroup memory limit if there is one, no limit otherwise.
+	uint64_t memory_budget;
+
+	// Recycle the input, decoded image and encoded chunk buffers between
+	// frames instead of allocating them for every frame. Free buffers are
+	// kept until the run is freed or paused.
+	bool buffer_pool;
+	// Back large pooled buffers with huge pages where the OS allows, ignored
+	// with a host allocator.
+	bool huge_pages;
+
+	// Zeroed for malloc/free and memory mapped pool buffers.
+	exrtool_allocator allocator;
+
+	// Complete frames in frame number order: a frame is reported done only
+	// once all earlier ones are. Frames are started in order at most
+	// `reorder_window` frames past the oldest one not done, and workers help
+	// running frames before starting new ones so that the head of the
+	// sequence is done as soon as possible. `schedule` is ignored.
+	bool ordered;
+	// 0 for twice the number of worker threads.
+	size_t reorder_window;
 
 	exrtool_progress_fn progress_fn;
 	void *progress_user;
 
+	// Called for every frame once it has been written (`ok`) or has failed,
+	// with the path of the output file.
+	exrtool_frame_fn frame_fn;
+	void *frame_user;
+
 } exrtool_input;
 
 typedef struct exrtool_progress {
@@ -35,10 +217,158 @@ typedef struct exrtool_progress {
 	size_t max;
 } exrtool_progress;
 
+typedef struct exrtool_stage_stats {
+	size_t workers;
+	// Workers currently processing an item and the items waiting in front
+	// of the stage.
+	size_t busy;
+	size_t queued;
+	size_t capacity;
+	// Items processed so far: input files for read and decode, frames after.
+	uint64_t items;
+	// Time summed over the workers spent processing items, waiting for input
+	// and blocked on a full queue to the next stage.
+	double busy_seconds;
+	double idle_seconds;
+	double blocked_seconds;
+} exrtool_stage_stats;
+
+typedef struct exrtool_stats {
+	// Total size of the input files and the number of bytes actually read
+	// from them, `bytes_read / input_bytes` is the read amplification. A
+	// memory mapped input counts as its whole size once mapped, not as the
+	// pages the decoder touches. Outside of Windows the mapping is read ahead
+	// in full.
+	uint64_t input_bytes;
+	uint64_t bytes_read;
+
+	// Number of input files that were memory mapped instead of read.
+	size_t files_mapped;
+
+	// Total size of the written output files.
+	uint64_t bytes_written;
+
+	// Number of input files read ahead by the prefetch threads.
+	size_t files_prefetched;
+	// Total time processing threads spent waiting for input files to be read.
+	double io_stall_seconds;
+
+	// Total time spent reading input files and writing output files, summed
+	// over all threads. `bytes_read / read_seconds` and
+	// `bytes_written / write_seconds` are the per-thread I/O throughputs.
+	double read_seconds;
+	double write_seconds;
+
+	// Average input and output rates in MB/s over the run so far, and the
+	// time summed over all threads spent waiting for the bandwidth caps.
+	double read_mbps;
+	double write_mbps;
+	double throttle_seconds;
+
+	// Peak size of the input, decoded and encoded image buffers held at once,
+	// and the peak estimate of the frames admitted under `memory_budget`.
+	uint64_t memory_peak;
+	uint64_t memory_estimate_peak;
+
+	// Page faults of the whole process since the start of the run, input,
+	// image and chunk buffers allocated and the ones reused from the pool,
+	// and the bytes of free buffers the pool holds.
+	uint64_t page_faults;
+	uint64_t buffers_allocated;
+	uint64_t buffers_reused;
+	uint64_t pool_bytes;
+
+	// Codec scratch memory held by the threads of the run, the temporary
+	// codec buffers that had to grow it and the ones served from it without
+	// allocating. Updated as threads finish tasks.
+	uint64_t scratch_bytes;
+	uint64_t scratch_allocations;
+	uint64_t scratch_reuses;
+
+	// Time from the start of the run until the last frame was done, zero
+	// while running, and a lower bound for it: the busy time of the workers
+	// divided by their average number over the run or the longest frame,
+	// whichever is larger. In pipeline mode the bound is the busy time of the
+	// slowest stage.
+	double makespan_seconds;
+	double ideal_makespan_seconds;
+
+	// Time from the start of the run until the first frame was done, in
+	// `ordered` mode the first frame of the sequence.
+	double first_frame_seconds;
+
+	// Set after `exrtool_cancel()`, with the time from cancelling until the
+	// last frame in flight was abandoned once the run is done.
+	bool cancelled;
+	double cancel_latency_seconds;
+
+	// Limits detected at the start of the run, zero where unknown or
+	// unlimited: the number of cores, the CPUs in the affinity mask, the
+	// cgroup CPU quota in CPUs, the cgroup memory limit and physical memory.
+	// `memory_budget` is the budget in effect.
+	size_t detected_cpus;
+	size_t affinity_cpus;
+	double cpu_quota;
+	uint64_t memory_limit;
+	uint64_t physical_memory;
+	uint64_t memory_budget;
+
+	// NUMA nodes the process may run on, zero on single node systems, and the
+	// chunk tasks run on another node than their frame with `numa`.
+	size_t numa_nodes;
+	uint64_t remote_tasks;
+
+	// Current number of worker threads and the average frame rate so far.
+	size_t num_threads;
+	double frames_per_second;
+
+	// Whether the run is paused, the threads parked so far and the total
+	// time spent paused, plus the bytes of read ahead inputs released.
+	bool paused;
+	size_t parked_threads;
+	double paused_seconds;
+	uint64_t bytes_released;
+
+	// Per stage utilization when running with `pipeline`, zero otherwise.
+	exrtool_stage_stats stages[EXRTOOL_STAGE_COUNT];
+} exrtool_stats;
+
+typedef struct exrtool_header_info {
+	// Size of the header attributes in bytes, excluding the 8 byte magic
+	// number and version.
+	size_t header_size;
+	// File offset of the chunk offset table.
+	size_t offset_table_pos;
+	// Number of bytes read from the file to find the end of the header.
+	size_t bytes_read;
+} exrtool_header_info;
+
+// Parse the header of `name` reading only as much of the file as needed to
+// find the end of the header. Returns a TINYEXR_ERROR code, on success the
+// header must be freed with `FreeEXRHeader()`. On failure `err` (if any) must
+// be freed with `FreeEXRErrorMessage()`.
+int exrtool_probe_header(const char *name, struct _EXRHeader *header, exrtool_header_info *info, const char **err);
+
 exrtool_run *exrtool_process(const exrtool_input *input);
 bool exrtool_poll(exrtool_run *run, exrtool_progress *progress);
+void exrtool_get_stats(exrtool_run *run, exrtool_stats *stats);
+// Stop processing as soon as possible: frames not started yet are skipped and
+// running ones abandoned at the next chunk, deleting partially written
+// outputs. Poll until done before freeing the run as usual.
+void exrtool_cancel(exrtool_run *run);
+// Change the number of worker threads, 0 for the default. Added workers start
+// right away, removed ones after finishing their current frame. Stops the
+// `auto_threads` tuning. No effect in pipeline mode.
+void exrtool_set_num_threads(exrtool_run *run, size_t num_threads);
+// Park every thread of the run at its next frame or chunk boundary and return
+// inputs read ahead for frames not yet started along with free heap memory to
+// the OS. Frames in flight keep their buffers and continue where they left
+// off after `exrtool_resume()`.
+void exrtool_pause(exrtool_run *run);
+void exrtool_resume(exrtool_run *run);
 size_t exrtool_get_num_errors(exrtool_run *run);
 const char *exrtool_get_error(exrtool_run *run, size_t index);
+// Resumes a paused run first.
 void exrtool_free(exrtool_run *run);
 
 #ifdef __cplusplus
@@ -110,6 +110,12 @@ extern "C" {
 // http://computation.llnl.gov/projects/floating-point-compression
 #endif
 
+// SSE2/AVX2/NEON versions of the byte reordering and predictor of ZIP and
+// RLE, chosen at runtime. The scalar versions are used otherwise.
+#ifndef TINYEXR_USE_SIMD
+#define TINYEXR_USE_SIMD (1)
+#endif
+
 #ifndef TINYEXR_USE_OPENMP
 #ifdef _OPENMP
 #define TINYEXR_USE_OPENMP (1)
@@ -161,6 +167,10 @@ extern "C" {
 #define TINYEXR_TILE_ROUND_DOWN (0)
 #define TINYEXR_TILE_ROUND_UP (1)
 
+// `kind` of an EXRAllocator allocation.
+#define TINYEXR_ALLOCATION_IMAGE (0)    // Pixel planes, tiles and their arrays.
+#define TINYEXR_ALLOCATION_ENCODED (1)  // Returned by SaveEXR*ToMemory.
+
 typedef struct _EXRVersion {
   int version;    // this must be 2
   // tile format image;
@@ -264,6 +274,14 @@ typedef struct _EXRMultiPartHeader {
 
 } EXRMultiPartHeader;
 
+// Allocator for the pixel data of an EXRImage and for the memory returned by
+// SaveEXR(Multipart)ImageToMemory, see `EXRImage::allocator`.
+typedef struct _EXRAllocator {
+  void *(*allocate)(size_t size, int kind, void *user);
+  void (*deallocate)(void *ptr, void *user);
+  void *user;
+} EXRAllocator;
+
 typedef struct _EXRImage {
   EXRTile *tiles;  // Tiled pixel data. The application must reconstruct image
                    // from tiles manually. NULL if scanline format.
@@ -280,6 +298,11 @@ typedef struct _EXRImage {
   // Properties for tile format.
   int num_tiles;
 
+  // Allocates `images`, `tiles` and their planes when loading, frees them in
+  // FreeEXRImage and allocates the memory returned when saving. Inherited by
+  // `next_level`. NULL for malloc/free. Must outlive the image.
+  const EXRAllocator *allocator;
+
 } EXRImage;
 
 typedef struct _EXRMultiPartImage {
@@ -438,6 +461,22 @@ extern int LoadEXRImageFromMemory(EXRImage *image, const EXRHeader *header,
                                   const unsigned char *memory,
                                   const size_t size, const char **err);
 
+// Loads single-part OpenEXR image from a memory, decoding only the channels
+// whose entry in `channel_mask`(array of `header->num_channels`) is non-zero.
+// The planes of the other channels are not allocated and are NULL in
+// `image->images`(or the tiles' images). Uncompressed data of skipped channels
+// is never read, compressed chunks are still inflated but not unpacked.
+// Application can free EXRImage using `FreeEXRImage`
+// Returns negative value and may set error string in `err` when there's an
+// error
+// When there was an error message, Application must free `err` with
+// FreeEXRErrorMessage()
+extern int LoadEXRImageChannelsFromMemory(EXRImage *image,
+                                          const EXRHeader *header,
+                                          const int *channel_mask,
+                                          const unsigned char *memory,
+                                          const size_t size, const char **err);
+
 // Loads multi-part OpenEXR image from a file.
 // Application must setup `ParseEXRMultipartHeaderFromFile` before calling this
 // function.
@@ -477,7 +516,8 @@ extern int SaveEXRImageToFile(const EXRImage *image,
 
 // Saves multi-channel, single-frame OpenEXR image to a memory.
 // Image is compressed using EXRImage.compression value.
-// Return the number of bytes if success.
+// Return the number of bytes if success. `memory` is allocated with the
+// allocator of `image`.
 // Return zero and will set error string in `err` when there's an
 // error.
 // When there was an error message, Application must free `err` with
@@ -486,6 +526,78 @@ extern size_t SaveEXRImageToMemory(const EXRImage *image,
                                    const EXRHeader *exr_header,
                                    unsigned char **memory, const char **err);
 
+// Scanline chunk API, used to read and write single-part scanline images
+// without holding the whole decoded or encoded image in memory.
+//
+// A file consists of the header from `SaveEXRHeaderToMemory`, an offset table
+// of `ceil(height / EXRNumScanlinesPerChunk())` little-endian 64-bit file
+// offsets and the chunks from `EncodeEXRScanlineChunk` in any order. The
+// result is identical to `SaveEXRImageToMemory` if the chunks are written in
+// increasing order.
+
+// Returns the number of scanlines stored in one chunk for `compression_type`.
+extern int EXRNumScanlinesPerChunk(int compression_type);
+
+// Serializes the magic number, version and attributes of a single-part
+// scanline image of `width` x `height` pixels.
+// Return the number of bytes if success, zero and sets `err` otherwise.
+// Application must free `memory` with free().
+extern size_t SaveEXRHeaderToMemory(const EXRHeader *exr_header, int width,
+                                    int height, unsigned char **memory,
+                                    const char **err);
+
+// Returns an upper bound for the encoded size of a chunk of `num_lines`.
+extern size_t EXRScanlineChunkBound(const EXRHeader *exr_header, int width,
+                                    int num_lines);
+
+// Encodes `num_lines` scanlines starting at line `y` into `out`, including
+// the scanline and data size prefix. `images[c]` points to the first pixel of
+// line `y` of channel `c`, lines are `width` pixels apart.
+// Return the number of bytes written if success, zero and sets `err`
+// otherwise.
+extern size_t EncodeEXRScanlineChunk(unsigned char *out, size_t out_size,
+                                     const EXRHeader *exr_header,
+                                     const unsigned char *const *images,
+                                     int width, int y, int num_lines,
+                                     const char **err);
+
+// Decodes chunk `chunk_index`, counted from the top of the data window, of a
+// single-part scanline image parsed from `memory`. `images[c]` receives up to
+// `EXRNumScanlinesPerChunk()` lines of data window width pixels of type
+// `requested_pixel_types[c]`, channels with a NULL plane are skipped. Lines
+// are stored top to bottom regardless of `line_order`. The number of decoded
+// lines is stored in `num_lines`.
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int DecodeEXRScanlineChunkFromMemory(unsigned char **images,
+                                            int *num_lines,
+                                            const EXRHeader *exr_header,
+                                            const unsigned char *memory,
+                                            size_t size, int chunk_index,
+                                            const char **err);
+
+// Temporary buffers of the chunk codecs (ZIP, RLE and PIZ) and of chunk
+// encoding, kept between calls on one thread instead of being allocated for
+// every chunk.
+typedef struct _EXRScratch EXRScratch;
+
+// Creates an empty scratch. Application must free it with FreeEXRScratch().
+extern EXRScratch *CreateEXRScratch(void);
+
+extern void FreeEXRScratch(EXRScratch *scratch);
+
+// Binds `scratch` to the calling thread, which then uses it for encoding and
+// decoding, or unbinds it with NULL. A scratch must not be bound to more than
+// one thread at a time and must stay alive while bound. Threads without a
+// scratch allocate their buffers per call. Requires C++11, a no-op
+// otherwise.
+extern void EXRSetThreadScratch(EXRScratch *scratch);
+
+// Bytes held by `scratch`, number of buffer requests which had to grow it and
+// number of requests served from it without allocating.
+extern void EXRScratchStats(const EXRScratch *scratch, size_t *bytes,
+                            size_t *allocations, size_t *reuses);
+
 // Saves multi-channel, multi-frame OpenEXR image to a memory.
 // Image is compressed using EXRImage.compression value.
 // File global attributes (eg. display_window) must be set in the first header.
@@ -501,7 +613,8 @@ extern int SaveEXRMultipartImageToFile(const EXRImage *images,
 // Saves multi-channel, multi-frame OpenEXR image to a memory.
 // Image is compressed using EXRImage.compression value.
 // File global attributes (eg. display_window) must be set in the first header.
-// Return the number of bytes if success.
+// Return the number of bytes if success. `memory` is allocated with the
+// allocator of the first image.
 // Return zero and will set error string in `err` when there's an
 // error.
 // When there was an error message, Application must free `err` with
@@ -594,6 +707,28 @@ extern int LoadEXRFromMemory(float **out_rgba, int *width, int *height,
 #include <omp.h>
 #endif
 
+#if TINYEXR_USE_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TINYEXR_SIMD_SSE2 (1)
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(_MSC_VER)
+// AVX2 is enabled per function and only used when the CPU supports it.
+#define TINYEXR_SIMD_AVX2 (1)
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TINYEXR_TARGET_AVX2
+#else
+#define TINYEXR_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TINYEXR_SIMD_NEON (1)
+#include <arm_neon.h>
+#endif
+#endif  // TINYEXR_USE_SIMD
+
 #if TINYEXR_USE_MINIZ
 #else
 //  Issue #46. Please include your own zlib-compatible API header before
@@ -7106,6 +7241,20 @@ void *mz_zip_extract_archive_file_to_heap(const char *pZip_filename,
 //  return bint.c[0] == 1;
 //}
 
+static void *Allocate(const EXRAllocator *allocator, size_t size, int kind) {
+  return allocator ? allocator->allocate(size, kind, allocator->user)
+                   : malloc(size);
+}
+
+static void Deallocate(const EXRAllocator *allocator, void *ptr) {
+  if (!ptr) return;
+  if (allocator) {
+    allocator->deallocate(ptr, allocator->user);
+  } else {
+    free(ptr);
+  }
+}
+
 static void SetErrorMessage(const std::string &msg, const char **err) {
   if (err) {
 #ifdef _WIN32
@@ -7652,56 +7801,550 @@ static void WriteChannelInfo(std::vector<unsigned char> &data,
   (*p) = '\0';
 }
 
-static void CompressZip(unsigned char *dst,
-                        tinyexr::tinyexr_uint64 &compressedSize,
-                        const unsigned char *src, unsigned long src_size) {
-  std::vector<unsigned char> tmpBuf(src_size);
+// Buffers of EXRScratch, one for every buffer that may be in use at the same
+// time on one thread.
+enum ScratchSlot {
+  kScratchPixels = 0,  // uncompressed pixel data of a chunk
+  kScratchBlock,       // compressed pixel data of a chunk
+  kScratchCodec,       // reordered bytes (ZIP, RLE), 16-bit samples (PIZ)
+  kScratchBitmap,      // PIZ value bitmap
+  kScratchLut,         // PIZ lookup table
+  kScratchFreq,        // Huffman code frequencies
+  kScratchHufDec,      // Huffman decoding table
+  kScratchHufLink,     // Huffman encoding table construction
+  kScratchHufHeap,
+  kScratchHufCode,
+  kScratchChunk,       // scanline chunk being assembled
+  kScratchStream,      // deflate/inflate stream state
+  kScratchSlots
+};
 
-  //
-  // Apply EXR-specific? postprocess. Grabbed from OpenEXR's
-  // ImfZipCompressor.cpp
-  //
+}  // namespace tinyexr
 
-  //
-  // Reorder the pixel data.
-  //
+struct _EXRScratch {
+  std::vector<unsigned char> slots[tinyexr::kScratchSlots];
+  std::vector<tinyexr::ChannelInfo> channels;
+  std::vector<size_t> channel_offsets;
+  size_t allocations;
+  size_t reuses;
+};
 
-  const char *srcPtr = reinterpret_cast<const char *>(src);
+namespace tinyexr {
 
-  {
-    char *t1 = reinterpret_cast<char *>(&tmpBuf.at(0));
-    char *t2 = reinterpret_cast<char *>(&tmpBuf.at(0)) + (src_size + 1) / 2;
-    const char *stop = srcPtr + src_size;
+#if TINYEXR_HAS_CXX11
+static thread_local EXRScratch *t_scratch = NULL;
+#else
+static EXRScratch *const t_scratch = NULL;
+#endif
+
+// `size` bytes from the scratch bound to the calling thread, holding data
+// left over from earlier calls, or from a zero-initialized vector owned by
+// the buffer without one.
+class ScratchBuffer {
+ public:
+  ScratchBuffer(ScratchSlot slot, size_t size) : vec_(&local_) {
+    if (t_scratch) {
+      vec_ = &t_scratch->slots[slot];
+      if (size > vec_->capacity()) {
+        t_scratch->allocations++;
+      } else {
+        t_scratch->reuses++;
+      }
+    }
+    vec_->resize(size);
+  }
 
-    for (;;) {
-      if (srcPtr < stop)
-        *(t1++) = *(srcPtr++);
-      else
-        break;
+  std::vector<unsigned char> &vector() { return *vec_; }
 
-      if (srcPtr < stop)
-        *(t2++) = *(srcPtr++);
-      else
-        break;
-    }
+  template <typename T>
+  T *as() {
+    return vec_->empty() ? NULL : reinterpret_cast<T *>(&vec_->at(0));
   }
 
+ private:
+  ScratchBuffer(const ScratchBuffer &);
+  ScratchBuffer &operator=(const ScratchBuffer &);
+
+  std::vector<unsigned char> local_;
+  std::vector<unsigned char> *vec_;
+};
+
+#if TINYEXR_USE_MINIZ
+// mz_compress() and mz_uncompress() keeping the stream state, the largest
+// allocation per chunk, in the scratch of the calling thread. Allocations are
+// carved from the scratch in turn, the ones that do not fit go to the heap.
+struct ScratchArena {
+  unsigned char *base;
+  size_t size;
+  size_t used;
+};
+
+static void *ScratchStreamAlloc(void *opaque, size_t items, size_t size) {
+  ScratchArena *arena = reinterpret_cast<ScratchArena *>(opaque);
+  if (size != 0 && items > (std::numeric_limits<size_t>::max)() / size) {
+    return NULL;
+  }
+  size_t bytes = items * size;
+  size_t offset = (arena->used + 15) & ~static_cast<size_t>(15);
+  if (offset <= arena->size && bytes <= arena->size - offset) {
+    arena->used = offset + bytes;
+    return arena->base + offset;
+  }
+  return miniz::def_alloc_func(NULL, items, size);
+}
+
+static void ScratchStreamFree(void *opaque, void *address) {
+  ScratchArena *arena = reinterpret_cast<ScratchArena *>(opaque);
+  unsigned char *p = reinterpret_cast<unsigned char *>(address);
+  if (p >= arena->base && p < arena->base + arena->size) return;
+  miniz::def_free_func(NULL, address);
+}
+
+static int ScratchCompress(unsigned char *dst, miniz::mz_ulong *dst_len,
+                           const unsigned char *src, miniz::mz_ulong src_len) {
+  if (!t_scratch || (src_len | *dst_len) > 0xFFFFFFFFU) {
+    return miniz::mz_compress(dst, dst_len, src, src_len);
+  }
+
+  ScratchBuffer state(kScratchStream, sizeof(miniz::tdefl_compressor));
+  ScratchArena arena = {state.as<unsigned char>(), state.vector().size(), 0};
+  miniz::mz_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.next_in = src;
+  stream.avail_in = static_cast<miniz::mz_uint32>(src_len);
+  stream.next_out = dst;
+  stream.avail_out = static_cast<miniz::mz_uint32>(*dst_len);
+  stream.zalloc = ScratchStreamAlloc;
+  stream.zfree = ScratchStreamFree;
+  stream.opaque = &arena;
+
+  int status = miniz::mz_deflateInit(&stream, miniz::MZ_DEFAULT_COMPRESSION);
+  if (status != miniz::MZ_OK) return status;
+
+  status = miniz::mz_deflate(&stream, miniz::MZ_FINISH);
+  if (status != miniz::MZ_STREAM_END) {
+    miniz::mz_deflateEnd(&stream);
+    return (status == miniz::MZ_OK) ? miniz::MZ_BUF_ERROR : status;
+  }
+
+  *dst_len = stream.total_out;
+  return miniz::mz_deflateEnd(&stream);
+}
+
+static int ScratchUncompress(unsigned char *dst, miniz::mz_ulong *dst_len,
+                             const unsigned char *src,
+                             miniz::mz_ulong src_len) {
+  if (!t_scratch || (src_len | *dst_len) > 0xFFFFFFFFU) {
+    return miniz::mz_uncompress(dst, dst_len, src, src_len);
+  }
+
+  ScratchBuffer state(kScratchStream, sizeof(miniz::inflate_state));
+  ScratchArena arena = {state.as<unsigned char>(), state.vector().size(), 0};
+  miniz::mz_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.next_in = src;
+  stream.avail_in = static_cast<miniz::mz_uint32>(src_len);
+  stream.next_out = dst;
+  stream.avail_out = static_cast<miniz::mz_uint32>(*dst_len);
+  stream.zalloc = ScratchStreamAlloc;
+  stream.zfree = ScratchStreamFree;
+  stream.opaque = &arena;
+
+  int status = miniz::mz_inflateInit(&stream);
+  if (status != miniz::MZ_OK) return status;
+
+  status = miniz::mz_inflate(&stream, miniz::MZ_FINISH);
+  if (status != miniz::MZ_STREAM_END) {
+    miniz::mz_inflateEnd(&stream);
+    return ((status == miniz::MZ_BUF_ERROR) && (!stream.avail_in))
+               ? miniz::MZ_DATA_ERROR
+               : status;
+  }
+  *dst_len = stream.total_out;
+
+  return miniz::mz_inflateEnd(&stream);
+}
+#endif
+
+// Byte reordering and predictor of ZIP and RLE, see ImfZipCompressor.cpp.
+// Encoding splits the bytes into the even and odd ones, the odd ones
+// starting at (n + 1) / 2, and replaces every byte but the first with its
+// difference to the previous one plus 128. Decoding reverses both steps.
+//
+// The scalar versions are the reference, they start at byte `begin` so that
+// the vector versions can finish the bytes they leave over. `begin` is even
+// for SplitBytes/MergeBytes.
+
+static void SplitBytesScalar(unsigned char *dst, const unsigned char *src,
+                             size_t n, size_t begin) {
+  unsigned char *t1 = dst + begin / 2;
+  unsigned char *t2 = dst + (n + 1) / 2 + begin / 2;
+  const unsigned char *s = src + begin;
+  const unsigned char *stop = src + n;
+
+  for (;;) {
+    if (s < stop)
+      *(t1++) = *(s++);
+    else
+      break;
+
+    if (s < stop)
+      *(t2++) = *(s++);
+    else
+      break;
+  }
+}
+
+static void MergeBytesScalar(unsigned char *dst, const unsigned char *src,
+                             size_t n, size_t begin) {
+  const unsigned char *t1 = src + begin / 2;
+  const unsigned char *t2 = src + (n + 1) / 2 + begin / 2;
+  unsigned char *s = dst + begin;
+  unsigned char *stop = dst + n;
+
+  for (;;) {
+    if (s < stop)
+      *(s++) = *(t1++);
+    else
+      break;
+
+    if (s < stop)
+      *(s++) = *(t2++);
+    else
+      break;
+  }
+}
+
+// Encodes bytes [1, end), which reads byte `end - 1` but not `end`.
+static void EncodePredictorScalar(unsigned char *buf, size_t end) {
+  if (end < 2) return;
+  unsigned char *t = buf + 1;
+  unsigned char *stop = buf + end;
+  int p = t[-1];
+
+  while (t < stop) {
+    int d = int(t[0]) - p + (128 + 256);
+    p = t[0];
+    t[0] = static_cast<unsigned char>(d);
+    ++t;
+  }
+}
+
+static void DecodePredictorScalar(unsigned char *buf, size_t n,
+                                  size_t begin) {
+  unsigned char *t = buf + (begin > 1 ? begin : 1);
+  unsigned char *stop = buf + n;
+
+  while (t < stop) {
+    int d = int(t[-1]) + int(t[0]) - 128;
+    t[0] = static_cast<unsigned char>(d);
+    ++t;
+  }
+}
+
+static void SplitBytesRef(unsigned char *dst, const unsigned char *src,
+                          size_t n) {
+  SplitBytesScalar(dst, src, n, 0);
+}
+
+static void MergeBytesRef(unsigned char *dst, const unsigned char *src,
+                          size_t n) {
+  MergeBytesScalar(dst, src, n, 0);
+}
+
+static void EncodePredictorRef(unsigned char *buf, size_t n) {
+  EncodePredictorScalar(buf, n);
+}
+
+static void DecodePredictorRef(unsigned char *buf, size_t n) {
+  DecodePredictorScalar(buf, n, 0);
+}
+
+// The vector predictors encode from the end backwards, so that the previous
+// byte is still unencoded, and decode with a prefix sum per vector. Adding
+// or subtracting 128 modulo 256 flips the top bit.
+
+#if TINYEXR_SIMD_SSE2
+static void SplitBytesSSE2(unsigned char *dst, const unsigned char *src,
+                           size_t n) {
+  unsigned char *t1 = dst;
+  unsigned char *t2 = dst + (n + 1) / 2;
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 16));
+    __m128i even =
+        _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    __m128i odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(t1 + i / 2), even);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(t2 + i / 2), odd);
+  }
+  SplitBytesScalar(dst, src, n, i);
+}
+
+static void MergeBytesSSE2(unsigned char *dst, const unsigned char *src,
+                           size_t n) {
+  const unsigned char *t1 = src;
+  const unsigned char *t2 = src + (n + 1) / 2;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m128i a =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(t1 + i / 2));
+    __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(t2 + i / 2));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_unpacklo_epi8(a, b));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 16),
+                     _mm_unpackhi_epi8(a, b));
+  }
+  MergeBytesScalar(dst, src, n, i);
+}
+
+static void EncodePredictorSSE2(unsigned char *buf, size_t n) {
+  const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+  size_t i = n;
+  while (i >= 16 + 1) {
+    i -= 16;
+    __m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+    __m128i prev =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i - 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buf + i),
+                     _mm_xor_si128(_mm_sub_epi8(cur, prev), bias));
+  }
+  EncodePredictorScalar(buf, i);
+}
+
+static void DecodePredictorSSE2(unsigned char *buf, size_t n) {
+  const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+  size_t i = 1;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i)), bias);
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi8(x, _mm_set1_epi8(static_cast<char>(buf[i - 1])));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buf + i), x);
+  }
+  DecodePredictorScalar(buf, n, i);
+}
+#endif  // TINYEXR_SIMD_SSE2
+
+#if TINYEXR_SIMD_AVX2
+// 256-bit packs and unpacks work on the 128-bit lanes separately, the
+// permutes restore the byte order.
+TINYEXR_TARGET_AVX2
+static void SplitBytesAVX2(unsigned char *dst, const unsigned char *src,
+                           size_t n) {
+  unsigned char *t1 = dst;
+  unsigned char *t2 = dst + (n + 1) / 2;
+  const __m256i mask = _mm256_set1_epi16(0x00ff);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 32));
+    __m256i even = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                                       _mm256_and_si256(b, mask));
+    __m256i odd =
+        _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(t1 + i / 2),
+                        _mm256_permute4x64_epi64(even, 0xd8));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(t2 + i / 2),
+                        _mm256_permute4x64_epi64(odd, 0xd8));
+  }
+  SplitBytesScalar(dst, src, n, i);
+}
+
+TINYEXR_TARGET_AVX2
+static void MergeBytesAVX2(unsigned char *dst, const unsigned char *src,
+                           size_t n) {
+  const unsigned char *t1 = src;
+  const unsigned char *t2 = src + (n + 1) / 2;
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m256i a =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(t1 + i / 2));
+    __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(t2 + i / 2));
+    __m256i lo = _mm256_unpacklo_epi8(a, b);
+    __m256i hi = _mm256_unpackhi_epi8(a, b);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  MergeBytesScalar(dst, src, n, i);
+}
+
+TINYEXR_TARGET_AVX2
+static void EncodePredictorAVX2(unsigned char *buf, size_t n) {
+  const __m256i bias = _mm256_set1_epi8(static_cast<char>(0x80));
+  size_t i = n;
+  while (i >= 32 + 1) {
+    i -= 32;
+    __m256i cur =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i));
+    __m256i prev =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i - 1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(buf + i),
+                        _mm256_xor_si256(_mm256_sub_epi8(cur, prev), bias));
+  }
+  EncodePredictorScalar(buf, i);
+}
+
+TINYEXR_TARGET_AVX2
+static void DecodePredictorAVX2(unsigned char *buf, size_t n) {
+  const __m256i bias = _mm256_set1_epi8(static_cast<char>(0x80));
+  const __m256i last = _mm256_set1_epi8(15);
+  size_t i = 1;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i)), bias);
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 1));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 2));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+    // Carry the sum of the low lane into the high lane.
+    __m256i carry = _mm256_shuffle_epi8(x, last);
+    x = _mm256_add_epi8(x, _mm256_permute2x128_si256(carry, carry, 0x08));
+    x = _mm256_add_epi8(x, _mm256_set1_epi8(static_cast<char>(buf[i - 1])));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(buf + i), x);
+  }
+  DecodePredictorScalar(buf, n, i);
+}
+
+static bool CpuHasAVX2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) return false;
+  __cpuid(info, 1);
+  // OSXSAVE and AVX, then the OS must save the YMM registers.
+  if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+  if ((_xgetbv(0) & 6) != 6) return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  // Includes the check for OS support.
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif  // TINYEXR_SIMD_AVX2
+
+#if TINYEXR_SIMD_NEON
+static void SplitBytesNEON(unsigned char *dst, const unsigned char *src,
+                           size_t n) {
+  unsigned char *t1 = dst;
+  unsigned char *t2 = dst + (n + 1) / 2;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    uint8x16x2_t v = vld2q_u8(src + i);
+    vst1q_u8(t1 + i / 2, v.val[0]);
+    vst1q_u8(t2 + i / 2, v.val[1]);
+  }
+  SplitBytesScalar(dst, src, n, i);
+}
+
+static void MergeBytesNEON(unsigned char *dst, const unsigned char *src,
+                           size_t n) {
+  const unsigned char *t1 = src;
+  const unsigned char *t2 = src + (n + 1) / 2;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    uint8x16x2_t v;
+    v.val[0] = vld1q_u8(t1 + i / 2);
+    v.val[1] = vld1q_u8(t2 + i / 2);
+    vst2q_u8(dst + i, v);
+  }
+  MergeBytesScalar(dst, src, n, i);
+}
+
+static void EncodePredictorNEON(unsigned char *buf, size_t n) {
+  const uint8x16_t bias = vdupq_n_u8(0x80);
+  size_t i = n;
+  while (i >= 16 + 1) {
+    i -= 16;
+    uint8x16_t cur = vld1q_u8(buf + i);
+    uint8x16_t prev = vld1q_u8(buf + i - 1);
+    vst1q_u8(buf + i, veorq_u8(vsubq_u8(cur, prev), bias));
+  }
+  EncodePredictorScalar(buf, i);
+}
+
+static void DecodePredictorNEON(unsigned char *buf, size_t n) {
+  const uint8x16_t bias = vdupq_n_u8(0x80);
+  const uint8x16_t zero = vdupq_n_u8(0);
+  size_t i = 1;
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t x = veorq_u8(vld1q_u8(buf + i), bias);
+    x = vaddq_u8(x, vextq_u8(zero, x, 15));
+    x = vaddq_u8(x, vextq_u8(zero, x, 14));
+    x = vaddq_u8(x, vextq_u8(zero, x, 12));
+    x = vaddq_u8(x, vextq_u8(zero, x, 8));
+    x = vaddq_u8(x, vdupq_n_u8(buf[i - 1]));
+    vst1q_u8(buf + i, x);
+  }
+  DecodePredictorScalar(buf, n, i);
+}
+#endif  // TINYEXR_SIMD_NEON
+
+struct ReorderKernels {
+  const char *name;
+  void (*split_bytes)(unsigned char *dst, const unsigned char *src, size_t n);
+  void (*merge_bytes)(unsigned char *dst, const unsigned char *src, size_t n);
+  void (*encode_predictor)(unsigned char *buf, size_t n);
+  void (*decode_predictor)(unsigned char *buf, size_t n);
+};
+
+static ReorderKernels SelectReorderKernels() {
+  ReorderKernels k = {"scalar", SplitBytesRef, MergeBytesRef,
+                      EncodePredictorRef, DecodePredictorRef};
+#if TINYEXR_SIMD_AVX2
+  if (CpuHasAVX2()) {
+    ReorderKernels avx2 = {"avx2", SplitBytesAVX2, MergeBytesAVX2,
+                           EncodePredictorAVX2, DecodePredictorAVX2};
+    return avx2;
+  }
+#endif
+#if TINYEXR_SIMD_SSE2
+  ReorderKernels sse2 = {"sse2", SplitBytesSSE2, MergeBytesSSE2,
+                         EncodePredictorSSE2, DecodePredictorSSE2};
+  k = sse2;
+#elif TINYEXR_SIMD_NEON
+  ReorderKernels neon = {"neon", SplitBytesNEON, MergeBytesNEON,
+                         EncodePredictorNEON, DecodePredictorNEON};
+  k = neon;
+#endif
+  return k;
+}
+
+static const ReorderKernels &GetReorderKernels() {
+  static const ReorderKernels kernels = SelectReorderKernels();
+  return kernels;
+}
+
+static void CompressZip(unsigned char *dst,
+                        tinyexr::tinyexr_uint64 &compressedSize,
+                        const unsigned char *src, unsigned long src_size) {
+  ScratchBuffer scratch(kScratchCodec, src_size);
+  std::vector<unsigned char> &tmpBuf = scratch.vector();
+
   //
-  // Predictor.
+  // Apply EXR-specific? postprocess. Grabbed from OpenEXR's
+  // ImfZipCompressor.cpp
   //
 
-  {
-    unsigned char *t = &tmpBuf.at(0) + 1;
-    unsigned char *stop = &tmpBuf.at(0) + src_size;
-    int p = t[-1];
+  const ReorderKernels &kernels = GetReorderKernels();
 
-    while (t < stop) {
-      int d = int(t[0]) - p + (128 + 256);
-      p = t[0];
-      t[0] = static_cast<unsigned char>(d);
-      ++t;
-    }
-  }
+  // Reorder the pixel data.
+  kernels.split_bytes(&tmpBuf.at(0), src, src_size);
+
+  // Predictor.
+  kernels.encode_predictor(&tmpBuf.at(0), src_size);
 
 #if TINYEXR_USE_MINIZ
   //
@@ -7709,7 +8352,7 @@ static void CompressZip(unsigned char *dst,
   //
 
   miniz::mz_ulong outSize = miniz::mz_compressBound(src_size);
-  int ret = miniz::mz_compress(
+  int ret = ScratchCompress(
       dst, &outSize, static_cast<const unsigned char *>(&tmpBuf.at(0)),
       src_size);
   assert(ret == miniz::MZ_OK);
@@ -7741,11 +8384,12 @@ static bool DecompressZip(unsigned char *dst,
     memcpy(dst, src, src_size);
     return true;
   }
-  std::vector<unsigned char> tmpBuf(*uncompressed_size);
+  ScratchBuffer scratch(kScratchCodec, *uncompressed_size);
+  std::vector<unsigned char> &tmpBuf = scratch.vector();
 
 #if TINYEXR_USE_MINIZ
   int ret =
-      miniz::mz_uncompress(&tmpBuf.at(0), uncompressed_size, src, src_size);
+      ScratchUncompress(&tmpBuf.at(0), uncompressed_size, src, src_size);
   if (miniz::MZ_OK != ret) {
     return false;
   }
@@ -7761,38 +8405,13 @@ static bool DecompressZip(unsigned char *dst,
   // ImfZipCompressor.cpp
   //
 
-  // Predictor.
-  {
-    unsigned char *t = &tmpBuf.at(0) + 1;
-    unsigned char *stop = &tmpBuf.at(0) + (*uncompressed_size);
+  const ReorderKernels &kernels = GetReorderKernels();
 
-    while (t < stop) {
-      int d = int(t[-1]) + int(t[0]) - 128;
-      t[0] = static_cast<unsigned char>(d);
-      ++t;
-    }
-  }
+  // Predictor.
+  kernels.decode_predictor(&tmpBuf.at(0), *uncompressed_size);
 
   // Reorder the pixel data.
-  {
-    const char *t1 = reinterpret_cast<const char *>(&tmpBuf.at(0));
-    const char *t2 = reinterpret_cast<const char *>(&tmpBuf.at(0)) +
-                     (*uncompressed_size + 1) / 2;
-    char *s = reinterpret_cast<char *>(dst);
-    char *stop = s + (*uncompressed_size);
-
-    for (;;) {
-      if (s < stop)
-        *(s++) = *(t1++);
-      else
-        break;
-
-      if (s < stop)
-        *(s++) = *(t2++);
-      else
-        break;
-    }
-  }
+  kernels.merge_bytes(dst, &tmpBuf.at(0), *uncompressed_size);
 
   return true;
 }
@@ -7920,53 +8539,21 @@ static int rleUncompress(int inLength, int maxLength, const signed char in[],
 static void CompressRle(unsigned char *dst,
                         tinyexr::tinyexr_uint64 &compressedSize,
                         const unsigned char *src, unsigned long src_size) {
-  std::vector<unsigned char> tmpBuf(src_size);
+  ScratchBuffer scratch(kScratchCodec, src_size);
+  std::vector<unsigned char> &tmpBuf = scratch.vector();
 
   //
   // Apply EXR-specific? postprocess. Grabbed from OpenEXR's
   // ImfRleCompressor.cpp
   //
 
-  //
-  // Reorder the pixel data.
-  //
-
-  const char *srcPtr = reinterpret_cast<const char *>(src);
-
-  {
-    char *t1 = reinterpret_cast<char *>(&tmpBuf.at(0));
-    char *t2 = reinterpret_cast<char *>(&tmpBuf.at(0)) + (src_size + 1) / 2;
-    const char *stop = srcPtr + src_size;
+  const ReorderKernels &kernels = GetReorderKernels();
 
-    for (;;) {
-      if (srcPtr < stop)
-        *(t1++) = *(srcPtr++);
-      else
-        break;
-
-      if (srcPtr < stop)
-        *(t2++) = *(srcPtr++);
-      else
-        break;
-    }
-  }
+  // Reorder the pixel data.
+  kernels.split_bytes(&tmpBuf.at(0), src, src_size);
 
-  //
   // Predictor.
-  //
-
-  {
-    unsigned char *t = &tmpBuf.at(0) + 1;
-    unsigned char *stop = &tmpBuf.at(0) + src_size;
-    int p = t[-1];
-
-    while (t < stop) {
-      int d = int(t[0]) - p + (128 + 256);
-      p = t[0];
-      t[0] = static_cast<unsigned char>(d);
-      ++t;
-    }
-  }
+  kernels.encode_predictor(&tmpBuf.at(0), src_size);
 
   // outSize will be (srcSiz * 3) / 2 at max.
   int outSize = rleCompress(static_cast<int>(src_size),
@@ -7999,7 +8586,8 @@ static bool DecompressRle(unsigned char *dst,
     return false;
   }
 
-  std::vector<unsigned char> tmpBuf(uncompressed_size);
+  ScratchBuffer scratch(kScratchCodec, uncompressed_size);
+  std::vector<unsigned char> &tmpBuf = scratch.vector();
 
   int ret = rleUncompress(static_cast<int>(src_size),
                           static_cast<int>(uncompressed_size),
@@ -8014,38 +8602,13 @@ static bool DecompressRle(unsigned char *dst,
   // ImfRleCompressor.cpp
   //
 
-  // Predictor.
-  {
-    unsigned char *t = &tmpBuf.at(0) + 1;
-    unsigned char *stop = &tmpBuf.at(0) + uncompressed_size;
+  const ReorderKernels &kernels = GetReorderKernels();
 
-    while (t < stop) {
-      int d = int(t[-1]) + int(t[0]) - 128;
-      t[0] = static_cast<unsigned char>(d);
-      ++t;
-    }
-  }
+  // Predictor.
+  kernels.decode_predictor(&tmpBuf.at(0), uncompressed_size);
 
   // Reorder the pixel data.
-  {
-    const char *t1 = reinterpret_cast<const char *>(&tmpBuf.at(0));
-    const char *t2 = reinterpret_cast<const char *>(&tmpBuf.at(0)) +
-                     (uncompressed_size + 1) / 2;
-    char *s = reinterpret_cast<char *>(dst);
-    char *stop = s + uncompressed_size;
-
-    for (;;) {
-      if (s < stop)
-        *(s++) = *(t1++);
-      else
-        break;
-
-      if (s < stop)
-        *(s++) = *(t2++);
-      else
-        break;
-    }
-  }
+  kernels.merge_bytes(dst, &tmpBuf.at(0), uncompressed_size);
 
   return true;
 }
@@ -8547,8 +9110,11 @@ static void hufBuildEncTable(
   //    for all array entries.
   //
 
-  std::vector<int> hlink(HUF_ENCSIZE);
-  std::vector<long long *> fHeap(HUF_ENCSIZE);
+  ScratchBuffer hlink_scratch(kScratchHufLink, sizeof(int) * HUF_ENCSIZE);
+  ScratchBuffer fheap_scratch(kScratchHufHeap,
+                              sizeof(long long *) * HUF_ENCSIZE);
+  int *hlink = hlink_scratch.as<int>();
+  long long **fHeap = fheap_scratch.as<long long *>();
 
   *im = 0;
 
@@ -8607,8 +9173,9 @@ static void hufBuildEncTable(
 
   std::make_heap(&fHeap[0], &fHeap[nf], FHeapCompare());
 
-  std::vector<long long> scode(HUF_ENCSIZE);
-  memset(scode.data(), 0, sizeof(long long) * HUF_ENCSIZE);
+  ScratchBuffer scode_scratch(kScratchHufCode, sizeof(long long) * HUF_ENCSIZE);
+  long long *scode = scode_scratch.as<long long>();
+  memset(scode, 0, sizeof(long long) * HUF_ENCSIZE);
 
   while (nf > 1) {
     //
@@ -8680,8 +9247,8 @@ static void hufBuildEncTable(
   // code table from scode into frq.
   //
 
-  hufCanonicalCodeTable(scode.data());
-  memcpy(frq, scode.data(), sizeof(long long) * HUF_ENCSIZE);
+  hufCanonicalCodeTable(scode);
+  memcpy(frq, scode, sizeof(long long) * HUF_ENCSIZE);
 }
 
 //
@@ -9195,7 +9762,7 @@ static bool hufDecode(const long long *hcode,  // i : encoding table
   return true;
 }
 
-static void countFrequencies(std::vector<long long> &freq,
+static void countFrequencies(long long freq[HUF_ENCSIZE],
                              const unsigned short data[/*n*/], int n) {
   for (int i = 0; i < HUF_ENCSIZE; ++i) freq[i] = 0;
 
@@ -9226,21 +9793,22 @@ static int hufCompress(const unsigned short raw[], int nRaw,
                        char compressed[]) {
   if (nRaw == 0) return 0;
 
-  std::vector<long long> freq(HUF_ENCSIZE);
+  ScratchBuffer freq_scratch(kScratchFreq, sizeof(long long) * HUF_ENCSIZE);
+  long long *freq = freq_scratch.as<long long>();
 
   countFrequencies(freq, raw, nRaw);
 
   int im = 0;
   int iM = 0;
-  hufBuildEncTable(freq.data(), &im, &iM);
+  hufBuildEncTable(freq, &im, &iM);
 
   char *tableStart = compressed + 20;
   char *tableEnd = tableStart;
-  hufPackEncTable(freq.data(), im, iM, &tableEnd);
+  hufPackEncTable(freq, im, iM, &tableEnd);
   int tableLength = tableEnd - tableStart;
 
   char *dataStart = tableEnd;
-  int nBits = hufEncode(freq.data(), raw, nRaw, iM, dataStart);
+  int nBits = hufEncode(freq, raw, nRaw, iM, dataStart);
   int data_length = (nBits + 7) / 8;
 
   writeUInt(compressed, im);
@@ -9253,9 +9821,9 @@ static int hufCompress(const unsigned short raw[], int nRaw,
 }
 
 static bool hufUncompress(const char compressed[], int nCompressed,
-                          std::vector<unsigned short> *raw) {
+                          unsigned short raw[/*nRaw*/], size_t nRaw) {
   if (nCompressed == 0) {
-    if (raw->size() != 0) return false;
+    if (nRaw != 0) return false;
 
     return false;
   }
@@ -9282,22 +9850,22 @@ static bool hufUncompress(const char compressed[], int nCompressed,
   //}
   // else
   {
-    std::vector<long long> freq(HUF_ENCSIZE);
-    std::vector<HufDec> hdec(HUF_DECSIZE);
+    ScratchBuffer freq_scratch(kScratchFreq, sizeof(long long) * HUF_ENCSIZE);
+    ScratchBuffer hdec_scratch(kScratchHufDec, sizeof(HufDec) * HUF_DECSIZE);
+    long long *freq = freq_scratch.as<long long>();
+    HufDec *hdec = hdec_scratch.as<HufDec>();
 
-    hufClearDecTable(&hdec.at(0));
+    hufClearDecTable(hdec);
 
-    hufUnpackEncTable(&ptr, nCompressed - (ptr - compressed), im, iM,
-                      &freq.at(0));
+    hufUnpackEncTable(&ptr, nCompressed - (ptr - compressed), im, iM, freq);
 
     {
       if (nBits > 8 * (nCompressed - (ptr - compressed))) {
         return false;
       }
 
-      hufBuildDecTable(&freq.at(0), im, iM, &hdec.at(0));
-      hufDecode(&freq.at(0), &hdec.at(0), ptr, nBits, iM, raw->size(),
-                raw->data());
+      hufBuildDecTable(freq, im, iM, hdec);
+      hufDecode(freq, hdec, ptr, nBits, iM, static_cast<int>(nRaw), raw);
     }
     // catch (...)
     //{
@@ -9305,7 +9873,7 @@ static bool hufUncompress(const char compressed[], int nCompressed,
     //    throw;
     //}
 
-    hufFreeDecTable(&hdec.at(0));
+    hufFreeDecTable(hdec);
   }
 
   return true;
@@ -9386,7 +9954,8 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
                         const unsigned char *inPtr, size_t inSize,
                         const std::vector<ChannelInfo> &channelInfo,
                         int data_width, int num_lines) {
-  std::vector<unsigned char> bitmap(BITMAP_SIZE);
+  ScratchBuffer bitmap_scratch(kScratchBitmap, BITMAP_SIZE);
+  std::vector<unsigned char> &bitmap = bitmap_scratch.vector();
   unsigned short minNonZero;
   unsigned short maxNonZero;
 
@@ -9397,10 +9966,13 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
 #endif
 
   // Assume `inSize` is multiple of 2 or 4.
-  std::vector<unsigned short> tmpBuffer(inSize / sizeof(unsigned short));
+  size_t tmpBufferSize = inSize / sizeof(unsigned short);
+  ScratchBuffer tmp_scratch(kScratchCodec,
+                            tmpBufferSize * sizeof(unsigned short));
+  unsigned short *tmpBuffer = tmp_scratch.as<unsigned short>();
 
   std::vector<PIZChannelData> channelData(channelInfo.size());
-  unsigned short *tmpBufferEnd = &tmpBuffer.at(0);
+  unsigned short *tmpBufferEnd = tmpBuffer;
 
   for (size_t c = 0; c < channelData.size(); c++) {
     PIZChannelData &cd = channelData[c];
@@ -9437,12 +10009,13 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
     }
   }
 
-  bitmapFromData(&tmpBuffer.at(0), static_cast<int>(tmpBuffer.size()),
-                 bitmap.data(), minNonZero, maxNonZero);
+  bitmapFromData(tmpBuffer, static_cast<int>(tmpBufferSize), bitmap.data(),
+                 minNonZero, maxNonZero);
 
-  std::vector<unsigned short> lut(USHORT_RANGE);
-  unsigned short maxValue = forwardLutFromBitmap(bitmap.data(), lut.data());
-  applyLut(lut.data(), &tmpBuffer.at(0), static_cast<int>(tmpBuffer.size()));
+  ScratchBuffer lut_scratch(kScratchLut, sizeof(unsigned short) * USHORT_RANGE);
+  unsigned short *lut = lut_scratch.as<unsigned short>();
+  unsigned short maxValue = forwardLutFromBitmap(bitmap.data(), lut);
+  applyLut(lut, tmpBuffer, static_cast<int>(tmpBufferSize));
 
   //
   // Store range compression info in _outBuffer
@@ -9485,8 +10058,7 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
   memcpy(buf, &zero, sizeof(int));
   buf += sizeof(int);
 
-  int length =
-      hufCompress(&tmpBuffer.at(0), static_cast<int>(tmpBuffer.size()), buf);
+  int length = hufCompress(tmpBuffer, static_cast<int>(tmpBufferSize), buf);
   memcpy(lengthPtr, &length, sizeof(int));
 
   (*outSize) = static_cast<unsigned int>(
@@ -9512,7 +10084,8 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
     return true;
   }
 
-  std::vector<unsigned char> bitmap(BITMAP_SIZE);
+  ScratchBuffer bitmap_scratch(kScratchBitmap, BITMAP_SIZE);
+  std::vector<unsigned char> &bitmap = bitmap_scratch.vector();
   unsigned short minNonZero;
   unsigned short maxNonZero;
 
@@ -9541,9 +10114,10 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
     ptr += maxNonZero - minNonZero + 1;
   }
 
-  std::vector<unsigned short> lut(USHORT_RANGE);
-  memset(lut.data(), 0, sizeof(unsigned short) * USHORT_RANGE);
-  unsigned short maxValue = reverseLutFromBitmap(bitmap.data(), lut.data());
+  ScratchBuffer lut_scratch(kScratchLut, sizeof(unsigned short) * USHORT_RANGE);
+  unsigned short *lut = lut_scratch.as<unsigned short>();
+  memset(lut, 0, sizeof(unsigned short) * USHORT_RANGE);
+  unsigned short maxValue = reverseLutFromBitmap(bitmap.data(), lut);
 
   //
   // Huffman decoding
@@ -9559,8 +10133,13 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
     return false;
   }
 
-  std::vector<unsigned short> tmpBuffer(tmpBufSize);
-  hufUncompress(reinterpret_cast<const char *>(ptr), length, &tmpBuffer);
+  ScratchBuffer tmp_scratch(kScratchCodec, tmpBufSize * sizeof(unsigned short));
+  unsigned short *tmpBuffer = tmp_scratch.as<unsigned short>();
+  // Scratch memory holds old data, corrupt or short input leaves zeros as
+  // before.
+  memset(tmpBuffer, 0, tmpBufSize * sizeof(unsigned short));
+  hufUncompress(reinterpret_cast<const char *>(ptr), length, tmpBuffer,
+                tmpBufSize);
 
   //
   // Wavelet decoding
@@ -9568,7 +10147,7 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
 
   std::vector<PIZChannelData> channelData(static_cast<size_t>(num_channels));
 
-  unsigned short *tmpBufferEnd = &tmpBuffer.at(0);
+  unsigned short *tmpBufferEnd = tmpBuffer;
 
   for (size_t i = 0; i < static_cast<size_t>(num_channels); ++i) {
     const EXRChannelInfo &chan = channels[i];
@@ -9601,7 +10180,7 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
   // Expand the pixel data to their original range
   //
 
-  applyLut(lut.data(), &tmpBuffer.at(0), static_cast<int>(tmpBufSize));
+  applyLut(lut, tmpBuffer, static_cast<int>(tmpBufSize));
 
   for (int y = 0; y < num_lines; y++) {
     for (size_t i = 0; i < channelData.size(); ++i) {
@@ -9882,8 +10461,9 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
     }
 
     // Allocate original data size.
-    std::vector<unsigned char> outBuf(static_cast<size_t>(
+    ScratchBuffer scratch(kScratchPixels, static_cast<size_t>(
         static_cast<size_t>(width * num_lines) * pixel_data_size));
+    std::vector<unsigned char> &outBuf = scratch.vector();
     size_t tmpBufLen = outBuf.size();
 
     bool ret = tinyexr::DecompressPiz(
@@ -9905,6 +10485,8 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
     //   pixel sample data for channel n for scanline 1
     //   ...
     for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+      if (!out_images[c]) continue;  // channel not requested
+
       if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
         for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
           const unsigned short *line_ptr = reinterpret_cast<unsigned short *>(
@@ -10021,9 +10603,10 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
   } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS ||
              compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
     // Allocate original data size.
-    std::vector<unsigned char> outBuf(static_cast<size_t>(width) *
-                                      static_cast<size_t>(num_lines) *
-                                      pixel_data_size);
+    ScratchBuffer scratch(kScratchPixels, static_cast<size_t>(width) *
+                                              static_cast<size_t>(num_lines) *
+                                              pixel_data_size);
+    std::vector<unsigned char> &outBuf = scratch.vector();
 
     unsigned long dstLen = static_cast<unsigned long>(outBuf.size());
     assert(dstLen > 0);
@@ -10032,6 +10615,10 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
             static_cast<unsigned long>(data_len))) {
       return false;
     }
+    // Scratch memory holds old data, a short stream leaves zeros as before.
+    if (dstLen < outBuf.size()) {
+      memset(&outBuf.at(dstLen), 0, outBuf.size() - dstLen);
+    }
 
     // For ZIP_COMPRESSION:
     //   pixel sample data for channel 0 for scanline 0
@@ -10044,6 +10631,8 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
     //   pixel sample data for channel n for scanline 1
     //   ...
     for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+      if (!out_images[c]) continue;  // channel not requested
+
       if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
         for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
           const unsigned short *line_ptr = reinterpret_cast<unsigned short *>(
@@ -10155,9 +10744,10 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
     }
   } else if (compression_type == TINYEXR_COMPRESSIONTYPE_RLE) {
     // Allocate original data size.
-    std::vector<unsigned char> outBuf(static_cast<size_t>(width) *
-                                      static_cast<size_t>(num_lines) *
-                                      pixel_data_size);
+    ScratchBuffer scratch(kScratchPixels, static_cast<size_t>(width) *
+                                              static_cast<size_t>(num_lines) *
+                                              pixel_data_size);
+    std::vector<unsigned char> &outBuf = scratch.vector();
 
     unsigned long dstLen = static_cast<unsigned long>(outBuf.size());
     if (dstLen == 0) {
@@ -10181,6 +10771,8 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
     //   pixel sample data for channel n for scanline 1
     //   ...
     for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+      if (!out_images[c]) continue;  // channel not requested
+
       if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
         for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
           const unsigned short *line_ptr = reinterpret_cast<unsigned short *>(
@@ -10299,9 +10891,10 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
     }
 
     // Allocate original data size.
-    std::vector<unsigned char> outBuf(static_cast<size_t>(width) *
-                                      static_cast<size_t>(num_lines) *
-                                      pixel_data_size);
+    ScratchBuffer scratch(kScratchPixels, static_cast<size_t>(width) *
+                                              static_cast<size_t>(num_lines) *
+                                              pixel_data_size);
+    std::vector<unsigned char> &outBuf = scratch.vector();
 
     unsigned long dstLen = outBuf.size();
     assert(dstLen > 0);
@@ -10321,6 +10914,8 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
     //   pixel sample data for channel n for scanline 1
     //   ...
     for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+      if (!out_images[c]) continue;  // channel not requested
+
       assert(channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT);
       if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
         assert(requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT);
@@ -10362,6 +10957,9 @@ static bool DecodePixelData(/* out */ unsigned char **out_images,
 #endif
   } else if (compression_type == TINYEXR_COMPRESSIONTYPE_NONE) {
     for (size_t c = 0; c < num_channels; c++) {
+      // Unrequested channels are skipped without touching their bytes.
+      if (!out_images[c]) continue;
+
       for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
         if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
           const unsigned short *line_ptr =
@@ -10548,15 +11146,23 @@ static bool ComputeChannelLayout(std::vector<size_t> *channel_offset_list,
   return true;
 }
 
-static unsigned char **AllocateImage(int num_channels,
+// Channels with a zero entry in `channel_mask` get a NULL plane.
+static unsigned char **AllocateImage(const EXRAllocator *allocator,
+                                     int num_channels,
                                      const EXRChannelInfo *channels,
                                      const int *requested_pixel_types,
-                                     int data_width, int data_height) {
+                                     int data_width, int data_height,
+                                     const int *channel_mask = NULL) {
   unsigned char **images =
-      reinterpret_cast<unsigned char **>(static_cast<float **>(
-          malloc(sizeof(float *) * static_cast<size_t>(num_channels))));
+      reinterpret_cast<unsigned char **>(static_cast<float **>(Allocate(
+          allocator, sizeof(float *) * static_cast<size_t>(num_channels),
+          TINYEXR_ALLOCATION_IMAGE)));
 
   for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+    if (channel_mask && !channel_mask[c]) {
+      images[c] = NULL;
+      continue;
+    }
     size_t data_len =
         static_cast<size_t>(data_width) * static_cast<size_t>(data_height);
     if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
@@ -10566,10 +11172,12 @@ static unsigned char **AllocateImage(int num_channels,
       if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
         images[c] =
             reinterpret_cast<unsigned char *>(static_cast<unsigned short *>(
-                malloc(sizeof(unsigned short) * data_len)));
+                Allocate(allocator, sizeof(unsigned short) * data_len,
+                         TINYEXR_ALLOCATION_IMAGE)));
       } else if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT) {
         images[c] = reinterpret_cast<unsigned char *>(
-            static_cast<float *>(malloc(sizeof(float) * data_len)));
+            static_cast<float *>(Allocate(allocator, sizeof(float) * data_len,
+                                          TINYEXR_ALLOCATION_IMAGE)));
       } else {
         assert(0);
       }
@@ -10577,12 +11185,14 @@ static unsigned char **AllocateImage(int num_channels,
       // pixel_data_size += sizeof(float);
       // channel_offset += sizeof(float);
       images[c] = reinterpret_cast<unsigned char *>(
-          static_cast<float *>(malloc(sizeof(float) * data_len)));
+          static_cast<float *>(Allocate(allocator, sizeof(float) * data_len,
+                                        TINYEXR_ALLOCATION_IMAGE)));
     } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
       // pixel_data_size += sizeof(unsigned int);
       // channel_offset += sizeof(unsigned int);
       images[c] = reinterpret_cast<unsigned char *>(
-          static_cast<unsigned int *>(malloc(sizeof(unsigned int) * data_len)));
+          static_cast<unsigned int *>(Allocate(allocator, sizeof(unsigned int) * data_len,
+                                               TINYEXR_ALLOCATION_IMAGE)));
     } else {
       assert(0);
     }
@@ -11087,6 +11697,7 @@ static int DecodeTiledLevel(EXRImage* exr_image, const EXRHeader* exr_header,
   const std::vector<size_t>& channel_offset_list,
   int pixel_data_size,
   const unsigned char* head, const size_t size,
+  const int* channel_mask,
   std::string* err) {
   int num_channels = exr_header->num_channels;
 
@@ -11122,8 +11733,10 @@ static int DecodeTiledLevel(EXRImage* exr_image, const EXRHeader* exr_header,
     err_code = TINYEXR_ERROR_INVALID_DATA;
   }
 #endif
-  exr_image->tiles = static_cast<EXRTile*>(
-    calloc(sizeof(EXRTile), static_cast<size_t>(num_tiles)));
+  exr_image->tiles = static_cast<EXRTile*>(tinyexr::Allocate(
+    exr_image->allocator, sizeof(EXRTile) * static_cast<size_t>(num_tiles),
+    TINYEXR_ALLOCATION_IMAGE));
+  memset(exr_image->tiles, 0, sizeof(EXRTile) * static_cast<size_t>(num_tiles));
 
 #if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
   std::vector<std::thread> workers;
@@ -11148,9 +11761,9 @@ static int DecodeTiledLevel(EXRImage* exr_image, const EXRHeader* exr_header,
 #endif
     // Allocate memory for each tile.
     exr_image->tiles[tile_idx].images = tinyexr::AllocateImage(
-      num_channels, exr_header->channels,
+      exr_image->allocator, num_channels, exr_header->channels,
       exr_header->requested_pixel_types, exr_header->tile_size_x,
-      exr_header->tile_size_y);
+      exr_header->tile_size_y, channel_mask);
 
     int x_tile = tile_idx % num_x_tiles;
     int y_tile = tile_idx / num_x_tiles;
@@ -11257,7 +11870,7 @@ static int DecodeTiledLevel(EXRImage* exr_image, const EXRHeader* exr_header,
 static int DecodeChunk(EXRImage *exr_image, const EXRHeader *exr_header,
                        const OffsetData& offset_data,
                        const unsigned char *head, const size_t size,
-                       std::string *err) {
+                       std::string *err, const int *channel_mask = NULL) {
   int num_channels = exr_header->num_channels;
 
   int num_scanline_blocks = 1;
@@ -11365,6 +11978,7 @@ static int DecodeChunk(EXRImage *exr_image, const EXRHeader *exr_header,
         } else {
           level_image->next_level = new EXRImage;
           InitEXRImage(level_image->next_level);
+          level_image->next_level->allocator = exr_image->allocator;
           level_image = level_image->next_level;
         }
         level_image->width =
@@ -11379,6 +11993,7 @@ static int DecodeChunk(EXRImage *exr_image, const EXRHeader *exr_header,
           channel_offset_list,
           pixel_data_size,
           head, size,
+          channel_mask,
           err);
         if (ret != TINYEXR_SUCCESS) return ret;
       }
@@ -11391,6 +12006,7 @@ static int DecodeChunk(EXRImage *exr_image, const EXRHeader *exr_header,
           } else {
             level_image->next_level = new EXRImage;
             InitEXRImage(level_image->next_level);
+            level_image->next_level->allocator = exr_image->allocator;
             level_image = level_image->next_level;
           }
 
@@ -11406,6 +12022,7 @@ static int DecodeChunk(EXRImage *exr_image, const EXRHeader *exr_header,
             channel_offset_list,
             pixel_data_size,
             head, size,
+            channel_mask,
             err);
           if (ret != TINYEXR_SUCCESS) return ret;
         }
@@ -11429,8 +12046,17 @@ static int DecodeChunk(EXRImage *exr_image, const EXRHeader *exr_header,
     }
 
     exr_image->images = tinyexr::AllocateImage(
-        num_channels, exr_header->channels, exr_header->requested_pixel_types,
-        data_width, data_height);
+        exr_image->allocator, num_channels, exr_header->channels, exr_header->requested_pixel_types,
+        data_width, data_height, channel_mask);
+
+    // Nothing to decode if no channel was requested.
+    if (channel_mask) {
+      bool any_channel = false;
+      for (int c = 0; c < num_channels; c++) {
+        if (channel_mask[c]) any_channel = true;
+      }
+      if (!any_channel) num_blocks = 0;
+    }
 
 #if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
     std::vector<std::thread> workers;
@@ -11972,7 +12598,7 @@ static int ReadOffsets(OffsetData& offset_data,
 static int DecodeEXRImage(EXRImage *exr_image, const EXRHeader *exr_header,
                           const unsigned char *head,
                           const unsigned char *marker, const size_t size,
-                          const char **err) {
+                          const char **err, const int *channel_mask = NULL) {
   if (exr_image == NULL || exr_header == NULL || head == NULL ||
       marker == NULL || (size <= tinyexr::kEXRVersionSize)) {
     tinyexr::SetErrorMessage("Invalid argument for DecodeEXRImage().", err);
@@ -12116,7 +12742,8 @@ static int DecodeEXRImage(EXRImage *exr_image, const EXRHeader *exr_header,
 
   {
     std::string e;
-    int ret = DecodeChunk(exr_image, exr_header, offset_data, head, size, &e);
+    int ret = DecodeChunk(exr_image, exr_header, offset_data, head, size, &e,
+                          channel_mask);
 
     if (ret != TINYEXR_SUCCESS) {
       if (!e.empty()) {
@@ -12795,6 +13422,31 @@ int LoadEXRImageFromMemory(EXRImage *exr_image, const EXRHeader *exr_header,
                                  err);
 }
 
+int LoadEXRImageChannelsFromMemory(EXRImage *exr_image,
+                                   const EXRHeader *exr_header,
+                                   const int *channel_mask,
+                                   const unsigned char *memory,
+                                   const size_t size, const char **err) {
+  if (exr_image == NULL || memory == NULL || channel_mask == NULL ||
+      (size < tinyexr::kEXRVersionSize)) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for LoadEXRImageChannelsFromMemory", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (exr_header->header_len == 0) {
+    tinyexr::SetErrorMessage("EXRHeader variable is not initialized.", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  const unsigned char *head = memory;
+  const unsigned char *marker = reinterpret_cast<const unsigned char *>(
+      memory + exr_header->header_len +
+      8);  // +8 for magic number + version header.
+  return tinyexr::DecodeEXRImage(exr_image, exr_header, head, marker, size,
+                                 err, channel_mask);
+}
+
 namespace tinyexr
 {
 
@@ -12821,7 +13473,8 @@ static bool EncodePixelData(/* out */ std::vector<unsigned char>& out_data,
   //int last2bit = (buf_size & 3);
   // buf_size must be multiple of four
   //if(last2bit) buf_size += 4 - last2bit;
-  std::vector<unsigned char> buf(buf_size);
+  ScratchBuffer buf_scratch(kScratchPixels, buf_size);
+  std::vector<unsigned char> &buf = buf_scratch.vector();
 
   size_t start_y = static_cast<size_t>(line_no);
   for (size_t c = 0; c < channels.size(); c++) {
@@ -12939,12 +13592,13 @@ static bool EncodePixelData(/* out */ std::vector<unsigned char>& out_data,
   } else if ((compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS) ||
     (compression_type == TINYEXR_COMPRESSIONTYPE_ZIP)) {
 #if TINYEXR_USE_MINIZ
-    std::vector<unsigned char> block(tinyexr::miniz::mz_compressBound(
+    ScratchBuffer block_scratch(kScratchBlock, tinyexr::miniz::mz_compressBound(
       static_cast<unsigned long>(buf.size())));
 #else
-    std::vector<unsigned char> block(
+    ScratchBuffer block_scratch(kScratchBlock,
       compressBound(static_cast<uLong>(buf.size())));
 #endif
+    std::vector<unsigned char> &block = block_scratch.vector();
     tinyexr::tinyexr_uint64 outSize = block.size();
 
     tinyexr::CompressZip(&block.at(0), outSize,
@@ -12960,7 +13614,8 @@ static bool EncodePixelData(/* out */ std::vector<unsigned char>& out_data,
 
   } else if (compression_type == TINYEXR_COMPRESSIONTYPE_RLE) {
     // (buf.size() * 3) / 2 would be enough.
-    std::vector<unsigned char> block((buf.size() * 3) / 2);
+    ScratchBuffer block_scratch(kScratchBlock, (buf.size() * 3) / 2);
+    std::vector<unsigned char> &block = block_scratch.vector();
 
     tinyexr::tinyexr_uint64 outSize = block.size();
 
@@ -12980,7 +13635,8 @@ static bool EncodePixelData(/* out */ std::vector<unsigned char>& out_data,
       8192 + static_cast<unsigned int>(
         2 * static_cast<unsigned int>(
           buf.size()));  // @fixme { compute good bound. }
-    std::vector<unsigned char> block(bufLen);
+    ScratchBuffer block_scratch(kScratchBlock, bufLen);
+    std::vector<unsigned char> &block = block_scratch.vector();
     unsigned int outSize = static_cast<unsigned int>(block.size());
 
     CompressPiz(&block.at(0), &outSize,
@@ -13359,51 +14015,15 @@ static int EncodeChunk(const EXRImage* exr_image, const EXRHeader* exr_header,
   return TINYEXR_SUCCESS;
 }
 
-// can save a single or multi-part image (no deep* formats)
-static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
-                                        const EXRHeader** exr_headers,
-                                        unsigned int num_parts,
-                                        unsigned char** memory_out, const char** err) {
-  if (exr_images == NULL || exr_headers == NULL || num_parts == 0 ||
-      memory_out == NULL) {
-    SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
-                    err);
-    return 0;
-  }
-  {
-    for (unsigned int i = 0; i < num_parts; ++i) {
-      if (exr_headers[i]->compression_type < 0) {
-        SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
-                        err);
-        return 0;
-      }
-#if !TINYEXR_USE_PIZ
-      if (exr_headers[i]->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
-        SetErrorMessage("PIZ compression is not supported in this build",
-                        err);
-        return 0;
-      }
-#endif
-#if !TINYEXR_USE_ZFP
-      if (exr_headers[i]->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
-        SetErrorMessage("ZFP compression is not supported in this build",
-                        err);
-        return 0;
-      }
-#else
-      for (int c = 0; c < exr_header->num_channels; ++c) {
-        if (exr_headers[i]->requested_pixel_types[c] != TINYEXR_PIXELTYPE_FLOAT) {
-          SetErrorMessage("Pixel type must be FLOAT for ZFP compression",
-                          err);
-          return 0;
-        }
-      }
-#endif
-    }
-  }
-
-  std::vector<unsigned char> memory;
-
+// Writes magic number, version and the attributes of all parts to `memory`
+// and fills `channels` with the channel list written for each part.
+static bool WriteEXRHeader(std::vector<unsigned char>& memory,
+                           const EXRImage* exr_images,
+                           const EXRHeader** exr_headers,
+                           unsigned int num_parts,
+                           const std::vector<int>& chunk_count,
+                           std::vector< std::vector<tinyexr::ChannelInfo> >& channels,
+                           const char** err) {
   // Header
   {
     const char header[] = { 0x76, 0x2f, 0x31, 0x01 };
@@ -13435,28 +14055,8 @@ static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
     memory.insert(memory.end(), marker, marker + 4);
   }
 
-  int total_chunk_count = 0;
-  std::vector<int> chunk_count(num_parts);
-  std::vector<OffsetData> offset_data(num_parts);
-  for (unsigned int i = 0; i < num_parts; ++i) {
-    if (!exr_images[i].tiles) {
-      int num_scanlines = NumScanlines(exr_headers[i]->compression_type);
-      chunk_count[i] =
-        (exr_images[i].height + num_scanlines - 1) / num_scanlines;
-      InitSingleResolutionOffsets(offset_data[i], chunk_count[i]);
-      total_chunk_count += chunk_count[i];
-    } else {
-      {
-        std::vector<int> num_x_tiles, num_y_tiles;
-        PrecalculateTileInfo(num_x_tiles, num_y_tiles, exr_headers[i]);
-        chunk_count[i] =
-          InitTileOffsets(offset_data[i], exr_headers[i], num_x_tiles, num_y_tiles);
-        total_chunk_count += chunk_count[i];
-      }
-    }
-  }
   // Write attributes to memory buffer.
-  std::vector< std::vector<tinyexr::ChannelInfo> > channels(num_parts);
+  channels.resize(num_parts);
   {
     std::set<std::string> partnames;
     for (unsigned int i = 0; i < num_parts; ++i) {
@@ -13566,7 +14166,7 @@ static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
             partnames.insert(std::string(exr_headers[i]->name));
             if (partnames.size() != i + 1) {
               SetErrorMessage("'name' attributes must be unique for a multi-part file", err);
-              return 0;
+              return false;
             }
             WriteAttributeToMemory(
               &memory, "name", "string",
@@ -13574,7 +14174,7 @@ static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
               static_cast<int>(len));
           } else {
             SetErrorMessage("Invalid 'name' attribute for a multi-part file", err);
-            return 0;
+            return false;
           }
         }
         // type
@@ -13616,6 +14216,79 @@ static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
     // end of header list
     memory.push_back(0);
   }
+  return true;
+}
+
+// can save a single or multi-part image (no deep* formats)
+static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
+                                        const EXRHeader** exr_headers,
+                                        unsigned int num_parts,
+                                        unsigned char** memory_out, const char** err) {
+  if (exr_images == NULL || exr_headers == NULL || num_parts == 0 ||
+      memory_out == NULL) {
+    SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
+                    err);
+    return 0;
+  }
+  {
+    for (unsigned int i = 0; i < num_parts; ++i) {
+      if (exr_headers[i]->compression_type < 0) {
+        SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
+                        err);
+        return 0;
+      }
+#if !TINYEXR_USE_PIZ
+      if (exr_headers[i]->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
+        SetErrorMessage("PIZ compression is not supported in this build",
+                        err);
+        return 0;
+      }
+#endif
+#if !TINYEXR_USE_ZFP
+      if (exr_headers[i]->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+        SetErrorMessage("ZFP compression is not supported in this build",
+                        err);
+        return 0;
+      }
+#else
+      for (int c = 0; c < exr_header->num_channels; ++c) {
+        if (exr_headers[i]->requested_pixel_types[c] != TINYEXR_PIXELTYPE_FLOAT) {
+          SetErrorMessage("Pixel type must be FLOAT for ZFP compression",
+                          err);
+          return 0;
+        }
+      }
+#endif
+    }
+  }
+
+  int total_chunk_count = 0;
+  std::vector<int> chunk_count(num_parts);
+  std::vector<OffsetData> offset_data(num_parts);
+  for (unsigned int i = 0; i < num_parts; ++i) {
+    if (!exr_images[i].tiles) {
+      int num_scanlines = NumScanlines(exr_headers[i]->compression_type);
+      chunk_count[i] =
+        (exr_images[i].height + num_scanlines - 1) / num_scanlines;
+      InitSingleResolutionOffsets(offset_data[i], chunk_count[i]);
+      total_chunk_count += chunk_count[i];
+    } else {
+      {
+        std::vector<int> num_x_tiles, num_y_tiles;
+        PrecalculateTileInfo(num_x_tiles, num_y_tiles, exr_headers[i]);
+        chunk_count[i] =
+          InitTileOffsets(offset_data[i], exr_headers[i], num_x_tiles, num_y_tiles);
+        total_chunk_count += chunk_count[i];
+      }
+    }
+  }
+
+  std::vector<unsigned char> memory;
+  std::vector< std::vector<tinyexr::ChannelInfo> > channels;
+  if (!WriteEXRHeader(memory, exr_images, exr_headers, num_parts, chunk_count,
+                      channels, err)) {
+    return 0;
+  }
 
   tinyexr_uint64 chunk_offset = memory.size() + size_t(total_chunk_count) * sizeof(tinyexr_uint64);
 
@@ -13647,7 +14320,9 @@ static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
     tinyexr::SetErrorMessage("Output memory size is zero", err);
     return 0;
   }
-  (*memory_out) = static_cast<unsigned char*>(malloc(total_size));
+  (*memory_out) = static_cast<unsigned char*>(
+      Allocate(exr_images[0].allocator, total_size,
+               TINYEXR_ALLOCATION_ENCODED));
 
   // Writing header
   memcpy((*memory_out), &memory[0], memory.size());
@@ -13711,6 +14386,287 @@ size_t SaveEXRImageToMemory(const EXRImage* exr_image,
   return tinyexr::SaveEXRNPartImageToMemory(exr_image, &exr_header, 1, memory_out, err);
 }
 
+int EXRNumScanlinesPerChunk(int compression_type) {
+  return tinyexr::NumScanlines(compression_type);
+}
+
+size_t SaveEXRHeaderToMemory(const EXRHeader *exr_header, int width,
+                             int height, unsigned char **memory_out,
+                             const char **err) {
+  if (exr_header == NULL || memory_out == NULL || width <= 0 ||
+      height <= 0 || exr_header->compression_type < 0) {
+    tinyexr::SetErrorMessage("Invalid argument for SaveEXRHeaderToMemory",
+                             err);
+    return 0;
+  }
+
+#if !TINYEXR_USE_PIZ
+  if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
+    tinyexr::SetErrorMessage("PIZ compression is not supported in this build",
+                             err);
+    return 0;
+  }
+#endif
+
+#if !TINYEXR_USE_ZFP
+  if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+    tinyexr::SetErrorMessage("ZFP compression is not supported in this build",
+                             err);
+    return 0;
+  }
+#endif
+
+  EXRImage exr_image;
+  InitEXRImage(&exr_image);
+  exr_image.width = width;
+  exr_image.height = height;
+
+  int num_scanlines = tinyexr::NumScanlines(exr_header->compression_type);
+  std::vector<int> chunk_count(1, (height + num_scanlines - 1) / num_scanlines);
+
+  std::vector<unsigned char> memory;
+  std::vector<std::vector<tinyexr::ChannelInfo> > channels;
+  if (!tinyexr::WriteEXRHeader(memory, &exr_image, &exr_header, 1,
+                               chunk_count, channels, err)) {
+    return 0;
+  }
+
+  (*memory_out) = static_cast<unsigned char *>(malloc(memory.size()));
+  memcpy((*memory_out), &memory.at(0), memory.size());
+  return memory.size();
+}
+
+size_t EXRScanlineChunkBound(const EXRHeader *exr_header, int width,
+                             int num_lines) {
+  size_t pixel_data_size = 0;
+  for (int c = 0; c < exr_header->num_channels; c++) {
+    if (exr_header->requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
+      pixel_data_size += sizeof(unsigned short);
+    } else {
+      pixel_data_size += sizeof(float);
+    }
+  }
+
+  // Large enough for every codec: ZIP needs compressBound(), RLE 3/2 and PIZ
+  // 8192 + 2x the raw size.
+  size_t raw_size =
+      static_cast<size_t>(width) * static_cast<size_t>(num_lines) *
+      pixel_data_size;
+  return 8 + 8192 + 2 * raw_size;
+}
+
+size_t EncodeEXRScanlineChunk(unsigned char *out, size_t out_size,
+                              const EXRHeader *exr_header,
+                              const unsigned char *const *images, int width,
+                              int y, int num_lines, const char **err) {
+  if (out == NULL || exr_header == NULL || images == NULL || width <= 0 ||
+      num_lines <= 0) {
+    tinyexr::SetErrorMessage("Invalid argument for EncodeEXRScanlineChunk",
+                             err);
+    return 0;
+  }
+
+  // Kept in the thread's scratch, reusing the name strings.
+  std::vector<tinyexr::ChannelInfo> local_channels;
+  std::vector<size_t> local_offsets;
+  EXRScratch *scratch = tinyexr::t_scratch;
+  std::vector<tinyexr::ChannelInfo> &channels =
+      scratch ? scratch->channels : local_channels;
+  std::vector<size_t> &channel_offset_list =
+      scratch ? scratch->channel_offsets : local_offsets;
+  channels.resize(static_cast<size_t>(exr_header->num_channels));
+  channel_offset_list.resize(static_cast<size_t>(exr_header->num_channels));
+  size_t pixel_data_size = 0;
+  for (int c = 0; c < exr_header->num_channels; c++) {
+    tinyexr::ChannelInfo &info = channels[static_cast<size_t>(c)];
+    info.p_linear = 0;
+    info.pixel_type = exr_header->requested_pixel_types[c];
+    info.x_sampling = 1;
+    info.y_sampling = 1;
+    info.name = exr_header->channels[c].name;
+
+    channel_offset_list[static_cast<size_t>(c)] = pixel_data_size;
+    if (info.pixel_type == TINYEXR_PIXELTYPE_HALF) {
+      pixel_data_size += sizeof(unsigned short);
+    } else {
+      pixel_data_size += sizeof(float);
+    }
+  }
+
+  const void *compression_param = 0;
+#if TINYEXR_USE_ZFP
+  tinyexr::ZFPCompressionParam zfp_compression_param;
+  {
+    std::string e;
+    bool ret = tinyexr::FindZFPCompressionParam(
+        &zfp_compression_param, exr_header->custom_attributes,
+        exr_header->num_custom_attributes, &e);
+
+    if (!ret) {
+      // Use predefined compression parameter.
+      zfp_compression_param.type = 0;
+      zfp_compression_param.rate = 2;
+    }
+    compression_param = &zfp_compression_param;
+  }
+#endif
+
+  // 4 byte: scan line
+  // 4 byte: data size
+  // ~     : pixel data
+  tinyexr::ScratchBuffer data_scratch(tinyexr::kScratchChunk, 2 * sizeof(int));
+  std::vector<unsigned char> &data = data_scratch.vector();
+  if (!tinyexr::EncodePixelData(data, images,
+                                exr_header->requested_pixel_types,
+                                exr_header->compression_type,
+                                0,  // increasing y
+                                width, num_lines, width, 0, num_lines,
+                                pixel_data_size, channels,
+                                channel_offset_list, compression_param)) {
+    tinyexr::SetErrorMessage("Failed to encode scanline data.", err);
+    return 0;
+  }
+
+  if (data.size() > out_size) {
+    tinyexr::SetErrorMessage("Output buffer too small for scanline chunk.",
+                             err);
+    return 0;
+  }
+
+  int data_len = static_cast<int>(data.size() - 2 * sizeof(int));
+  memcpy(&data[0], &y, sizeof(int));
+  memcpy(&data[4], &data_len, sizeof(int));
+  tinyexr::swap4(reinterpret_cast<int *>(&data[0]));
+  tinyexr::swap4(reinterpret_cast<int *>(&data[4]));
+
+  memcpy(out, &data.at(0), data.size());
+  return data.size();
+}
+
+int DecodeEXRScanlineChunkFromMemory(unsigned char **images, int *num_lines,
+                                     const EXRHeader *exr_header,
+                                     const unsigned char *memory, size_t size,
+                                     int chunk_index, const char **err) {
+  if (images == NULL || num_lines == NULL || exr_header == NULL ||
+      memory == NULL || chunk_index < 0 || exr_header->tiled ||
+      exr_header->header_len == 0) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for DecodeEXRScanlineChunkFromMemory", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  const EXRBox2i &dw = exr_header->data_window;
+  if (dw.max_x < dw.min_x || dw.max_y < dw.min_y ||
+      dw.max_x - dw.min_x >= TINYEXR_DIMENSION_THRESHOLD ||
+      dw.max_y - dw.min_y >= TINYEXR_DIMENSION_THRESHOLD) {
+    tinyexr::SetErrorMessage("Invalid data window.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  int data_width = dw.max_x - dw.min_x + 1;
+  int data_height = dw.max_y - dw.min_y + 1;
+
+  int num_scanlines = tinyexr::NumScanlines(exr_header->compression_type);
+  int num_blocks = (data_height + num_scanlines - 1) / num_scanlines;
+  if (chunk_index >= num_blocks) {
+    tinyexr::SetErrorMessage("Chunk index out of range.", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  // +8 for magic number + version header.
+  size_t table_pos = size_t(exr_header->header_len) + 8 +
+                     size_t(chunk_index) * sizeof(tinyexr::tinyexr_uint64);
+  if (table_pos + sizeof(tinyexr::tinyexr_uint64) > size) {
+    tinyexr::SetErrorMessage("Insufficient data size in offset table.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  tinyexr::tinyexr_uint64 offset;
+  memcpy(&offset, memory + table_pos, sizeof(offset));
+  tinyexr::swap8(&offset);
+
+  if (offset >= size || size - offset < 8) {
+    tinyexr::SetErrorMessage("Invalid offset value.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  // 4 byte: scan line
+  // 4 byte: data size
+  // ~     : pixel data(uncompressed or compressed)
+  const unsigned char *data_ptr = memory + offset;
+  int line_no;
+  int data_len;
+  memcpy(&line_no, data_ptr, sizeof(int));
+  memcpy(&data_len, data_ptr + 4, sizeof(int));
+  tinyexr::swap4(&line_no);
+  tinyexr::swap4(&data_len);
+
+  int y = chunk_index * num_scanlines;
+  if (line_no != dw.min_y + y || data_len <= 0 ||
+      size_t(data_len) > size_t(size - offset - 8)) {
+    tinyexr::SetErrorMessage("Invalid scanline chunk.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  std::vector<size_t> local_offsets;
+  std::vector<size_t> &channel_offset_list =
+      tinyexr::t_scratch ? tinyexr::t_scratch->channel_offsets : local_offsets;
+  int pixel_data_size = 0;
+  size_t channel_offset = 0;
+  if (!tinyexr::ComputeChannelLayout(&channel_offset_list, &pixel_data_size,
+                                     &channel_offset, exr_header->num_channels,
+                                     exr_header->channels)) {
+    tinyexr::SetErrorMessage("Failed to compute channel layout.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  int lines = (std::min)(num_scanlines, data_height - y);
+  if (!tinyexr::DecodePixelData(
+          images, exr_header->requested_pixel_types, data_ptr + 8,
+          static_cast<size_t>(data_len), exr_header->compression_type,
+          0,  // increasing y
+          data_width, lines, data_width, 0, 0, lines,
+          static_cast<size_t>(pixel_data_size),
+          static_cast<size_t>(exr_header->num_custom_attributes),
+          exr_header->custom_attributes,
+          static_cast<size_t>(exr_header->num_channels), exr_header->channels,
+          channel_offset_list)) {
+    tinyexr::SetErrorMessage("Invalid data found when decoding pixels.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  (*num_lines) = lines;
+  return TINYEXR_SUCCESS;
+}
+
+EXRScratch *CreateEXRScratch(void) {
+  EXRScratch *scratch = new EXRScratch();
+  scratch->allocations = 0;
+  scratch->reuses = 0;
+  return scratch;
+}
+
+void FreeEXRScratch(EXRScratch *scratch) { delete scratch; }
+
+void EXRSetThreadScratch(EXRScratch *scratch) {
+#if TINYEXR_HAS_CXX11
+  tinyexr::t_scratch = scratch;
+#else
+  (void)scratch;
+#endif
+}
+
+void EXRScratchStats(const EXRScratch *scratch, size_t *bytes,
+                     size_t *allocations, size_t *reuses) {
+  size_t total = 0;
+  for (int i = 0; i < tinyexr::kScratchSlots; i++) {
+    total += scratch->slots[i].capacity();
+  }
+  total += scratch->channels.capacity() * sizeof(tinyexr::ChannelInfo);
+  total += scratch->channel_offsets.capacity() * sizeof(size_t);
+  if (bytes) (*bytes) = total;
+  if (allocations) (*allocations) = scratch->allocations;
+  if (reuses) (*reuses) = scratch->reuses;
+}
+
 int SaveEXRImageToFile(const EXRImage *exr_image, const EXRHeader *exr_header,
                        const char *filename, const char **err) {
   if (exr_image == NULL || filename == NULL ||
@@ -13768,7 +14724,7 @@ int SaveEXRImageToFile(const EXRImage *exr_image, const EXRHeader *exr_header,
   if ((mem_size > 0) && mem) {
     written_size = fwrite(mem, 1, mem_size, fp);
   }
-  free(mem);
+  tinyexr::Deallocate(exr_image->allocator, mem);
 
   fclose(fp);
 
@@ -13837,7 +14793,7 @@ int SaveEXRMultipartImageToFile(const EXRImage* exr_images,
   if ((mem_size > 0) && mem) {
     written_size = fwrite(mem, 1, mem_size, fp);
   }
-  free(mem);
+  tinyexr::Deallocate(exr_images[0].allocator, mem);
 
   fclose(fp);
 
@@ -14259,6 +15215,7 @@ void InitEXRImage(EXRImage *exr_image) {
   exr_image->level_y = 0;
 
   exr_image->num_tiles = 0;
+  exr_image->allocator = NULL;
 }
 
 void FreeEXRErrorMessage(const char *msg) {
@@ -14340,28 +15297,29 @@ int FreeEXRImage(EXRImage *exr_image) {
     delete exr_image->next_level;
   }
 
+  const EXRAllocator *allocator = exr_image->allocator;
   for (int i = 0; i < exr_image->num_channels; i++) {
     if (exr_image->images && exr_image->images[i]) {
-      free(exr_image->images[i]);
+      tinyexr::Deallocate(allocator, exr_image->images[i]);
     }
   }
 
   if (exr_image->images) {
-    free(exr_image->images);
+    tinyexr::Deallocate(allocator, exr_image->images);
   }
 
   if (exr_image->tiles) {
     for (int tid = 0; tid < exr_image->num_tiles; tid++) {
       for (int i = 0; i < exr_image->num_channels; i++) {
         if (exr_image->tiles[tid].images && exr_image->tiles[tid].images[i]) {
-          free(exr_image->tiles[tid].images[i]);
+          tinyexr::Deallocate(allocator, exr_image->tiles[tid].images[i]);
         }
       }
       if (exr_image->tiles[tid].images) {
-        free(exr_image->tiles[tid].images);
+        tinyexr::Deallocate(allocator, exr_image->tiles[tid].images);
       }
     }
-    free(exr_image->tiles);
+    tinyexr::Deallocate(allocator, exr_image->tiles);
   }
 
   return TINYEXR_SUCCESS;
@@ -51,22 +51,16 @@ struct UIFile
 	{
 		if (header) return header.get();
 
-		int ret = 0;
-
-		EXRVersion version;
-		ret = ParseEXRVersionFromFile(&version, name.c_str());
-		if (ret) {
-			error("Could not parse version\n%s", name.c_str());
-			return nullptr;
-		}
-
-		const char *err;
+		const char *err = nullptr;
 
+		// Only read the header instead of the whole file, a sequence can
+		// have thousands of large files.
 		EXRHeader *pHeader = new EXRHeader();
-		ret = ParseEXRHeaderFromFile(pHeader, &version, name.c_str(), &err);
+		int ret = exrtool_probe_header(name.c_str(), pHeader, nullptr, &err);
 		if (ret) {
-			error("Could not parse version\n%s\n%s", err, name.c_str());
+			error("Could not parse header\n%s\n%s", err ? err : "", name.c_str());
 			FreeEXRErrorMessage(err);
+			EXRHeaderDeleter()(pHeader);
 			return nullptr;
 		}
 
@@ -375,6 +369,11 @@ struct UIState
 		nk_layout_row_dynamic(ctx, 40.0f, 1);
 		nk_progress(ctx, &progress.done, progress.max, false);
 
+		nk_layout_row_dynamic(ctx, 30.0f, 1);
+		if (nk_button_label(ctx, "Cancel")) {
+			exrtool_cancel(tool_run);
+		}
+
 		nk_end(ctx);
 	}
 